@@ -7,6 +7,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 #include "types.h"
 
 template <typename T>
@@ -58,4 +61,45 @@ inline ncclResult_t ncclIbMallocDebug(void** ptr, size_t size, const char *filef
 }
 #define ncclIbMalloc(...) ncclIbMallocDebug(__VA_ARGS__, __FILE__, __LINE__)
 
+// Same as ncclIbMalloc, but the pages prefer NUMA node 'node' (ignored if < 0).
+// The policy is set before the pages are first touched. *actualNode receives the
+// node the first page landed on, -1 if unknown.
+#define NCCL_MPOL_PREFERRED 1
+#define NCCL_MPOL_MF_MOVE (1<<1)
+#define NCCL_MPOL_F_NODE (1<<0)
+#define NCCL_MPOL_F_ADDR (1<<1)
+#define NCCL_MPOL_MAX_NODES 1024
+// Set a preferred NUMA node policy on [p, p+size), before the pages are touched
+inline int ncclIbNumaBind(void* p, size_t size, int node) {
+  if (node < 0 || node >= NCCL_MPOL_MAX_NODES) return -1;
+  unsigned long mask[NCCL_MPOL_MAX_NODES/(8*sizeof(unsigned long))];
+  memset(mask, 0, sizeof(mask));
+  mask[node/(8*sizeof(unsigned long))] = 1UL << (node%(8*sizeof(unsigned long)));
+  return syscall(SYS_mbind, p, size, NCCL_MPOL_PREFERRED, mask, NCCL_MPOL_MAX_NODES+1, NCCL_MPOL_MF_MOVE) == 0 ? 0 : -1;
+}
+
+// NUMA node the (touched) page at p lives on, -1 if unknown
+inline int ncclIbNumaNodeOf(void* p) {
+  int node = -1;
+  if (syscall(SYS_get_mempolicy, &node, NULL, 0, p, NCCL_MPOL_F_NODE|NCCL_MPOL_F_ADDR) != 0) return -1;
+  return node;
+}
+
+inline ncclResult_t ncclIbMallocNumaDebug(void** ptr, size_t size, int node, int* actualNode, const char *filefunc, int line) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  void* p;
+  size_t size_aligned = ROUNDUP(size, page_size);
+  int ret = posix_memalign(&p, page_size, size_aligned);
+  if (ret != 0) return ncclSystemError;
+  if (node >= 0 && ncclIbNumaBind(p, size_aligned, node) != 0) {
+    INFO(NCCL_ALLOC, "%s:%d mbind to NUMA node %d failed: %s", filefunc, line, node, strerror(errno));
+  }
+  memset(p, 0, size);
+  *actualNode = ncclIbNumaNodeOf(p);
+  *ptr = p;
+  INFO(NCCL_ALLOC, "%s:%d Ib Alloc Size %ld pointer %p node %d/%d", filefunc, line, size, *ptr, *actualNode, node);
+  return ncclSuccess;
+}
+#define ncclIbMallocNuma(...) ncclIbMallocNumaDebug(__VA_ARGS__, __FILE__, __LINE__)
+
 #endif
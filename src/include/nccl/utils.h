@@ -6,6 +6,8 @@
 #define NCCL_UTILS_H_
 
 #include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 #include "types.h"
 
 struct netIf {
@@ -18,4 +20,10 @@ int matchIfList(const char* string, int port, struct netIf* ifList, int listSize
 
 const char *get_plugin_lib_path();
 
+static inline uint64_t clockNano() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec)*1000*1000*1000 + ts.tv_nsec;
+}
+
 #endif
@@ -19,137 +19,123 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 
 #include "logger.h"
 #include "stats.h"
 
 namespace ucommd {
 
-Stat::Stat(int id, Counter* base, std::vector<std::string> counter_list)
-    : id_(id), base_(base) {
-  size_t i = 0;
-  while (i < counter_list.size()) {
-    counter_by_name_.emplace(counter_list[i], (Counter*)(base_ + i));
-    i++;
-  }
-  num_counters_ = i;
+Stat::Stat(int id, Counter* base, size_t num_counters, size_t num_shards)
+    : id_(id), base_(base),
+      num_counters_(num_counters),
+      num_shards_(num_shards ? num_shards : 1) {
+  shard_stride_ = shardStride(num_counters_, num_shards_);
 }
 
 Stat::~Stat() {
   // clear();
-  counter_by_name_.clear();
   num_counters_ = 0;
   base_ = nullptr;
   id_ = -1;
 }
 
-int Stat::add(const std::string& name, size_t val) {
-  auto it = counter_by_name_.find(name);
-  if (it == counter_by_name_.end()) {
-    LogWarn("ucommd: counter %s not found", name.c_str());
-    return -1;
-  }
-  __atomic_add_fetch(it->second, val, __ATOMIC_SEQ_CST);
-  return 0;
+Counter* Stat::shard() const {
+  if (num_shards_ == 1) return base_;
+  // Threads take shards round robin on their first update
+  static std::atomic<size_t> next_shard{0};
+  static thread_local size_t thread_shard = next_shard.fetch_add(1, std::memory_order_relaxed);
+  return base_ + (thread_shard % num_shards_) * shard_stride_;
 }
 
 int Stat::add(const size_t i, size_t val) {
-  // check index?
-  __atomic_add_fetch(base_ + i, val, __ATOMIC_SEQ_CST);
-  return 0;
-}
-
-int Stat::sub(const std::string& name, size_t val) {
-  auto it = counter_by_name_.find(name);
-  if (it == counter_by_name_.end()) {
-    LogWarn("ucommd: counter %s not found", name.c_str());
-    return -1;
-  }
-  __atomic_sub_fetch(it->second, val, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(shard() + i, val, __ATOMIC_RELAXED);
   return 0;
 }
 
 int Stat::sub(const size_t i, size_t val) {
-  __atomic_sub_fetch(base_ + i, val, __ATOMIC_SEQ_CST);
-  return 0;
-}
-
-int Stat::inc(const std::string& name) {
-  auto it = counter_by_name_.find(name);
-  if (it == counter_by_name_.end()) {
-    LogWarn("ucommd: counter %s not found", name.c_str());
-    return -1;
-  }
-  __atomic_add_fetch(it->second, 1, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(shard() + i, val, __ATOMIC_RELAXED);
   return 0;
 }
 
 int Stat::inc(const size_t i) {
-  __atomic_add_fetch(base_ + i, 1, __ATOMIC_SEQ_CST);
-  return 0;
-}
-
-int Stat::dec(const std::string& name) {
-  auto it = counter_by_name_.find(name);
-  if (it == counter_by_name_.end()) {
-    LogWarn("ucommd: counter %s not found", name.c_str());
-    return -1;
-  }
-  __atomic_sub_fetch(it->second, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(shard() + i, 1, __ATOMIC_RELAXED);
   return 0;
 }
 
 int Stat::dec(const size_t i) {
-  __atomic_sub_fetch(base_ + i, 1, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(shard() + i, 1, __ATOMIC_RELAXED);
   return 0;
 }
 
-int Stat::get(const std::string& name, size_t& val) const {
-  auto it = counter_by_name_.find(name);
-  if (it == counter_by_name_.end()) {
-    LogWarn("ucommd: counter %s not found", name.c_str());
-    return -1;
+int Stat::get(const size_t i, size_t& val) const {
+  // Shards only ever add up, a counter decremented on one shard and
+  // incremented on another wraps around on both
+  val = 0;
+  for (size_t s = 0; s < num_shards_; s++) {
+    val += __atomic_load_n(base_ + s * shard_stride_ + i, __ATOMIC_RELAXED);
   }
-  val = __atomic_load_n(it->second, __ATOMIC_SEQ_CST);
   return 0;
 }
 
-int Stat::get(const size_t i, size_t& val) const {
-  val = __atomic_load_n(base_ + i, __ATOMIC_SEQ_CST);
+int Stat::record(const size_t i, size_t val) {
+  auto s = shard();
+  __atomic_add_fetch(s + i, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(s + i + 1 + Histogram::bucket(val), 1, __ATOMIC_RELAXED);
   return 0;
 }
 
-int Stat::set(const std::string& name, size_t val) {
-  auto it = counter_by_name_.find(name);
-  if (it == counter_by_name_.end()) {
-    LogWarn("ucommd: counter %s not found", name.c_str());
-    return -1;
-  }
-  __atomic_store_n(it->second, val, __ATOMIC_SEQ_CST);
-  return 0;
+size_t Stat::claim(const size_t i, size_t val) {
+  size_t expected = 0;
+  (void)__atomic_compare_exchange_n(base_ + i, &expected, val, false,
+      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  return expected;
 }
 
 int Stat::set(const size_t i, size_t val) {
-  __atomic_store_n(base_ + i, val, __ATOMIC_SEQ_CST);
+  // The value lives on the first shard, the others hold nothing of it
+  for (size_t s = 1; s < num_shards_; s++) {
+    __atomic_store_n(base_ + s * shard_stride_ + i, 0, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(base_ + i, val, __ATOMIC_RELAXED);
   return 0;
 }
 
 StatsShm::StatsShm(std::string id, std::string name,
-    size_t num_stats, std::vector<std::string> counter_list)
+    size_t num_stats, std::vector<CounterDef> counter_list,
+    size_t num_shards, int snapshot_ms, Ring ring)
     : id_(id), name_(name),
       num_counters_(counter_list.size()),
       num_stats_(num_stats),
+      num_shards_(num_shards ? num_shards : 1),
+      snapshot_ms_(snapshot_ms > 0 ? snapshot_ms : 0),
+      ring_(ring),
       counter_list_(counter_list),
       state_(CREATED) {
   std::unique_lock<std::mutex> lock(mutex_);
   for (size_t i = 0; i < num_stats_; i++) {
     stats_available_.push(i);
   }
+  if (ring_.interval_ms <= 0 || ring_.len == 0 || ring_.counters.empty()) {
+    ring_ = Ring();
+  }
 }
 
 StatsShm::~StatsShm() {
+  if (publisher_.joinable() || sampler_.joinable()) {
+    {
+      std::unique_lock<std::mutex> lock(publisher_mutex_);
+      publisher_stop_ = true;
+    }
+    publisher_cv_.notify_all();
+    if (publisher_.joinable()) publisher_.join();
+    if (sampler_.joinable()) sampler_.join();
+  }
   state_.store(ERROR);
   std::unique_lock<std::mutex> lock(mutex_);
   std::queue<int>().swap(stats_available_);
@@ -224,8 +210,21 @@ int StatsShm::init() {
 
   auto meta_size  = sizeof(Meta);
   auto desc_size  = sizeof(Desc) * num_counters_;
-  auto stats_size = sizeof(size_t) * num_counters_ * num_stats_;
-  auto total_size = meta_size + desc_size + stats_size;
+  auto shard_stride = Stat::shardStride(num_counters_, num_shards_);
+  auto stats_size = sizeof(size_t) * shard_stride * num_shards_ * num_stats_;
+  auto snap_offset = snapshot_ms_ ?
+      (meta_size + desc_size + stats_size + Stat::kShardAlign - 1) / Stat::kShardAlign * Stat::kShardAlign : 0;
+  auto snap_stride = (sizeof(Snapshot) + sizeof(size_t) * num_counters_ + Stat::kShardAlign - 1) /
+      Stat::kShardAlign * Stat::kShardAlign;
+  auto total_size = snapshot_ms_ ?
+      snap_offset + snap_stride * num_stats_ : meta_size + desc_size + stats_size;
+  auto align = [](size_t size) {
+    return (size + Stat::kShardAlign - 1) / Stat::kShardAlign * Stat::kShardAlign;
+  };
+  auto ring_offset = ring_.len ? align(total_size) : 0;
+  auto ring_entry_offset = ring_.len ? ring_offset + align(sizeof(int) * ring_.counters.size()) : 0;
+  auto ring_stride = align(sizeof(Snapshot) + sizeof(size_t) * num_stats_ * ring_.counters.size());
+  if (ring_.len) total_size = ring_entry_offset + ring_stride * ring_.len;
 
   auto addr = create_shm(total_size);
   if (addr == nullptr) {
@@ -246,28 +245,160 @@ int StatsShm::init() {
   meta_safe_.desc_size  = desc_size;
   meta_safe_.stats_size = stats_size;
   meta_safe_.total_size = total_size;
+  meta_safe_.shard_num  = num_shards_;
+  meta_safe_.shard_stride = shard_stride;
+  meta_safe_.hist_buckets = Histogram::kBuckets;
+  meta_safe_.hist_sub_bits = Histogram::kSubBits;
+  meta_safe_.snap_offset = snap_offset;
+  meta_safe_.snap_stride = snapshot_ms_ ? snap_stride : 0;
+  meta_safe_.snap_interval_ms = snapshot_ms_;
+  meta_safe_.ring_offset = ring_offset;
+  meta_safe_.ring_entry_offset = ring_entry_offset;
+  meta_safe_.ring_stride = ring_.len ? ring_stride : 0;
+  meta_safe_.ring_len = ring_.len;
+  meta_safe_.ring_interval_ms = ring_.interval_ms;
+  meta_safe_.ring_counter_num = ring_.counters.size();
 
   meta_ = (struct Meta*)addr;
   memcpy(meta_, &meta_safe_, sizeof(struct Meta));
 
   desc_ = (struct Desc*)(meta_ + 1);
   for (size_t i = 0; i < counter_list_.size(); i++) {
-    strncpy((desc_ + i)->name, counter_list_[i].c_str(), DESC_LEN_MAX - 1);
+    strncpy((desc_ + i)->name, counter_list_[i].name.c_str(), sizeof(desc_->name) - 1);
+    (desc_ + i)->kind = counter_list_[i].kind;
   }
 
   stats_ = (Counter*)(desc_ + num_counters_);
-  if ((uint64_t)stats_ % 8 != 0) {
+  if ((uint64_t)stats_ % (num_shards_ > 1 ? Stat::kShardAlign : 8) != 0) {
     LogWarn("ucommd: unable to initialize stats %s, invalid alignment",
         name_.c_str());
     state_.store(ERROR);
     return -1;
   }
 
+  snaps_ = snapshot_ms_ ? (char*)addr + snap_offset : nullptr;
+  if (snaps_) {
+    publisher_ = std::thread(&StatsShm::publish_func, this);
+  }
+
+  ring_entries_ = ring_.len ? (char*)addr + ring_entry_offset : nullptr;
+  if (ring_entries_) {
+    auto indices = (int*)((char*)addr + ring_offset);
+    for (size_t k = 0; k < ring_.counters.size(); k++) indices[k] = ring_.counters[k];
+    sampler_ = std::thread(&StatsShm::sample_func, this);
+  }
+
   LogInfo("ucommd: stats %s initialized", name_.c_str());
   state_.store(INITIALIZED);
   return 0;
 }
 
+void StatsShm::markRead(Meta* meta, uint64_t now_ns, int interval_ms) {
+  __atomic_store_n(&meta->reader_interval_ms, interval_ms, __ATOMIC_RELAXED);
+  __atomic_store_n(&meta->reader_ns, now_ns, __ATOMIC_RELAXED);
+}
+
+bool StatsShm::watched(uint64_t now_ns) const {
+  if (state_.load() != INITIALIZED) return false;
+  uint64_t last = __atomic_load_n(&meta_->reader_ns, __ATOMIC_RELAXED);
+  if (last == 0) return false;
+  uint64_t interval_ms = __atomic_load_n(&meta_->reader_interval_ms, __ATOMIC_RELAXED);
+  uint64_t timeout_ms = std::max(3 * interval_ms, kReaderTimeoutMs);
+  return now_ns < last + timeout_ms * 1000000;
+}
+
+void StatsShm::publish() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  auto shard_stride = meta_safe_.shard_stride;
+  for (size_t id = 0; id < num_stats_; id++) {
+    auto snap = (Snapshot*)(snaps_ + id * meta_safe_.snap_stride);
+    auto values = (Counter*)(snap + 1);
+    auto base = stats_ + id * shard_stride * num_shards_;
+    auto seq = snap->seq;
+    __atomic_store_n(&snap->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (size_t i = 0; i < num_counters_; i++) {
+      size_t val = 0;
+      for (size_t s = 0; s < num_shards_; s++) {
+        val += __atomic_load_n(base + s * shard_stride + i, __ATOMIC_RELAXED);
+      }
+      __atomic_store_n(values + i, val, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&snap->time_ns, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&snap->seq, seq + 2, __ATOMIC_RELEASE);
+  }
+}
+
+// The publisher and the sampler share the mutex only to wait for the stop,
+// their work runs unlocked so that neither delays the other
+void StatsShm::publish_func() {
+  std::unique_lock<std::mutex> lock(publisher_mutex_);
+  while (!publisher_stop_) {
+    lock.unlock();
+    publish();
+    lock.lock();
+    publisher_cv_.wait_for(lock, std::chrono::milliseconds(snapshot_ms_),
+        [this] { return publisher_stop_; });
+  }
+}
+
+void StatsShm::sample() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  auto shard_stride = meta_safe_.shard_stride;
+  auto head = meta_->ring_head;
+  auto entry = (Snapshot*)(ring_entries_ + (head % ring_.len) * meta_safe_.ring_stride);
+  auto values = (Counter*)(entry + 1);
+  auto seq = entry->seq;
+  __atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  for (size_t id = 0; id < num_stats_; id++) {
+    auto base = stats_ + id * shard_stride * num_shards_;
+    for (size_t k = 0; k < ring_.counters.size(); k++) {
+      size_t val = 0;
+      for (size_t s = 0; s < num_shards_; s++) {
+        val += __atomic_load_n(base + s * shard_stride + ring_.counters[k], __ATOMIC_RELAXED);
+      }
+      __atomic_store_n(values + id * ring_.counters.size() + k, val, __ATOMIC_RELAXED);
+    }
+  }
+  __atomic_store_n(&entry->time_ns, now, __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&meta_->ring_head, head + 1, __ATOMIC_RELEASE);
+}
+
+void StatsShm::sample_func() {
+  // Keep to the interval however long a sample takes
+  auto next = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(publisher_mutex_);
+  while (!publisher_stop_) {
+    lock.unlock();
+    sample();
+    lock.lock();
+    next += std::chrono::milliseconds(ring_.interval_ms);
+    publisher_cv_.wait_until(lock, next, [this] { return publisher_stop_; });
+  }
+}
+
+int StatsShm::readSnapshot(const Snapshot* snap, size_t counter_num,
+    size_t* values, uint64_t* time_ns) {
+  auto src = (const Counter*)(snap + 1);
+  for (int retry = 0; retry < 1000; retry++) {
+    auto seq = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) continue;
+    for (size_t i = 0; i < counter_num; i++) {
+      values[i] = __atomic_load_n(src + i, __ATOMIC_RELAXED);
+    }
+    *time_ns = __atomic_load_n(&snap->time_ns, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&snap->seq, __ATOMIC_RELAXED) == seq) return 0;
+  }
+  return -1;
+}
+
 int StatsShm::allocStat(StatPtr& stat) {
   std::unique_lock<std::mutex> lock(mutex_);
 
@@ -286,7 +417,7 @@ int StatsShm::allocStat(StatPtr& stat) {
   auto id = stats_available_.front();
   stats_available_.pop();
   stat = std::make_shared<Stat>(id,
-      stats_ + (id * num_counters_), counter_list_);
+      stats_ + (id * meta_safe_.shard_stride * num_shards_), num_counters_, num_shards_);
   stat->clear();
   stats_group_.insert(stat);
 
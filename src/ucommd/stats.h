@@ -15,55 +15,165 @@
 #include <mutex>
 #include <atomic>
 #include <memory>
+#include <thread>
+#include <condition_variable>
 
 namespace ucommd {
 
 using Counter = volatile size_t;
 
+#define PATH_LEN_MAX   256
+#define NAME_LEN_MAX   128
+#define DESC_LEN_MAX   128
+
+enum CounterKind {
+  kCounter = 0,
+  kHistogram,       // sample count, followed by the buckets
+  kHistogramBucket,
+};
+
+struct CounterDef {
+  std::string name;
+  int kind;
+  CounterDef(const std::string& n, int k = kCounter) : name(n), kind(k) {}
+  CounterDef(const char* n, int k = kCounter) : name(n), kind(k) {}
+};
+
+// A histogram takes 1 + kBuckets counters, the sample count then HDR style
+// buckets: values under kSub have their own bucket, above that each power of
+// two is split in kSub buckets, so that a bucket is at most 1/kSub wide.
+struct Histogram {
+  static constexpr const int kSubBits = 2;
+  static constexpr const size_t kSub = 1 << kSubBits;
+  static constexpr const size_t kBuckets = kSub + (64 - kSubBits) * kSub;
+
+  static size_t bucket(size_t v) {
+    if (v < kSub) return v;
+    int e = 63 - __builtin_clzll(v);
+    return kSub + (e - kSubBits) * kSub + ((v >> (e - kSubBits)) & (kSub - 1));
+  }
+  // Smallest value of bucket b
+  static size_t lower(size_t b) {
+    if (b < kSub) return b;
+    int e = (b - kSub) / kSub + kSubBits;
+    return (kSub + (b - kSub) % kSub) << (e - kSubBits);
+  }
+  static size_t width(size_t b) {
+    return b < kSub ? 1 : (size_t)1 << ((b - kSub) / kSub);
+  }
+  // Value under which a fraction q of the samples are, interpolated in the
+  // bucket it falls into. The count is the sum of the buckets: the sample
+  // count is bumped first and read apart, so it may be ahead of them
+  static size_t percentile(const size_t* buckets, double q) {
+    size_t count = 0;
+    for (size_t b = 0; b < kBuckets; b++) count += buckets[b];
+    if (count == 0) return 0;
+    double rank = q * count;
+    size_t seen = 0;
+    for (size_t b = 0; b < kBuckets; b++) {
+      if (buckets[b] == 0) continue;
+      if (seen + buckets[b] >= rank) {
+        return lower(b) + (size_t)(width(b) * ((rank - seen) / buckets[b]));
+      }
+      seen += buckets[b];
+    }
+    return lower(kBuckets - 1);
+  }
+};
+
+// Names show in the monitor, whose columns hold 16 characters except for
+// byte counters
+constexpr bool counterHas(const char* s, const char* w, size_t i = 0) {
+  return !w[i] || (s[i] == w[i] && counterHas(s, w, i + 1));
+}
+constexpr bool counterHasBytes(const char* s) {
+  return *s && (counterHas(s, "bytes") || counterHasBytes(s + 1));
+}
+constexpr size_t counterLen(const char* s) {
+  return *s ? 1 + counterLen(s + 1) : 0;
+}
+constexpr bool counterNameFits(const char* s) {
+  return counterLen(s) < DESC_LEN_MAX - 8 && (counterLen(s) <= 16 || counterHasBytes(s));
+}
+
+inline void addHistogramDefs(std::vector<CounterDef>& defs, const char* name) {
+  defs.emplace_back(name, kHistogram);
+  for (size_t b = 0; b < Histogram::kBuckets; b++) defs.emplace_back("", kHistogramBucket);
+}
+
+// A counter schema is declared once as X(ID, "name") counters and
+// H(ID, "name") histograms. It generates the enum the counters are updated
+// with, NameNum, and NameDefs, the list the shm Desc table is filled from, so
+// that both always agree.
+#define UCOMMD_COUNTER_ID(id, name) id,
+#define UCOMMD_HISTOGRAM_ID(id, name) id, id##_LAST_BUCKET = id + Histogram::kBuckets,
+#define UCOMMD_COUNTER_DEF(id, name) defs.emplace_back(name);
+#define UCOMMD_HISTOGRAM_DEF(id, name) addHistogramDefs(defs, name);
+#define UCOMMD_COUNTER_CHECK(id, name) \
+  static_assert(counterNameFits(name), "counter " name " is too long to show");
+#define UCOMMD_COUNTER_SCHEMA(Name, COUNTERS) \
+  enum Name : size_t { COUNTERS(UCOMMD_COUNTER_ID, UCOMMD_HISTOGRAM_ID) Name##Num }; \
+  COUNTERS(UCOMMD_COUNTER_CHECK, UCOMMD_COUNTER_CHECK) \
+  inline std::vector<CounterDef> Name##Defs() { \
+    std::vector<CounterDef> defs; \
+    COUNTERS(UCOMMD_COUNTER_DEF, UCOMMD_HISTOGRAM_DEF) \
+    return defs; }
+
+// The counters of a stat may be split into shards, each a full copy of the
+// counters starting on its own cache line. Writers update the shard of their
+// thread with relaxed atomics, so that threads bumping the same counter do not
+// bounce its line, and readers sum the shards.
 class Stat {
  public:
-  Stat(int id, Counter* base, std::vector<std::string> counter_list);
+  static constexpr const size_t kShardAlign = 64;
+
+  Stat(int id, Counter* base, size_t num_counters, size_t num_shards = 1);
   ~Stat();
 
+  // Distance in counters between the shards of a stat
+  static size_t shardStride(size_t num_counters, size_t num_shards) {
+    if (num_shards <= 1) return num_counters;
+    auto align = kShardAlign / sizeof(size_t);
+    return (num_counters + align - 1) / align * align;
+  }
+
   int getId() const {
     return id_; }
 
-  int add(const std::string& name, size_t val);
+  // Counters are indexed by the enum of their schema
   int add(const size_t i, size_t val);
-
-  int sub(const std::string& name, size_t val);
   int sub(const size_t i, size_t val);
-
-  int inc(const std::string& name);
   int inc(const size_t i);
-
-  int dec(const std::string& name);
   int dec(const size_t i);
-
-  int get(const std::string& name, size_t& val) const;
   int get(const size_t i, size_t& val) const;
-
-  int set(const std::string& name, size_t val);
   int set(const size_t i, size_t val);
 
+  // Add a sample to histogram i
+  int record(const size_t i, size_t val);
+
+  // Set counter i to val if it is 0, for keys that live on the first shard
+  // like values set. Returns the previous value, 0 when we set it.
+  size_t claim(const size_t i, size_t val);
+
   void clear() const {
-    for (size_t i = 0; i < num_counters_; i++) {
-      __atomic_store_n((Counter*)(base_ + i), 0, __ATOMIC_SEQ_CST);
+    for (size_t i = 0; i < num_shards_ * shard_stride_; i++) {
+      __atomic_store_n((Counter*)(base_ + i), 0, __ATOMIC_RELAXED);
     }
   }
 
+ private:
+  // Shard of the calling thread
+  Counter* shard() const;
+
  private:
   int id_ = -1;
   Counter* base_ = nullptr;
   size_t num_counters_ = 0;
-  std::unordered_map<std::string, Counter*> counter_by_name_;
+  size_t num_shards_ = 1;
+  size_t shard_stride_ = 0;
 };
 using StatPtr = std::shared_ptr<Stat>;
 
-#define PATH_LEN_MAX   256
-#define NAME_LEN_MAX   128
-#define DESC_LEN_MAX   128
-
 class StatsShm {
  public:
   struct Meta {
@@ -76,19 +186,72 @@ class StatsShm {
     int desc_size;
     int stats_size;
     int total_size;
-  } __attribute__((aligned(8)));
+    int shard_num;    // shards per stat, see Stat
+    int shard_stride; // in counters
+    int hist_buckets; // buckets per histogram, see Histogram
+    int hist_sub_bits;
+    int snap_offset;  // of the first Snapshot from the start of the shm, 0 without snapshots
+    int snap_stride;  // in bytes
+    int snap_interval_ms;
+    // Written by readers: CLOCK_MONOTONIC time one last looked at the stats,
+    // and how often it looks, see watched()
+    uint64_t reader_ns;
+    int reader_interval_ms;
+    // History ring, 0 ring_len without: the ring_counter_num int indices of
+    // the counters kept at ring_offset, then ring_len Snapshot entries of the
+    // stat_num * ring_counter_num values at ring_entry_offset. Entry n % ring_len
+    // is the n-th taken, ring_head of them were.
+    int ring_offset;
+    int ring_entry_offset;
+    int ring_stride;  // in bytes
+    int ring_len;
+    int ring_interval_ms;
+    int ring_counter_num;
+    uint64_t ring_head;
+  } __attribute__((aligned(64)));
 
   struct Desc {
-    char name[DESC_LEN_MAX];
+    char name[DESC_LEN_MAX - 8];
+    int kind; // CounterKind
+    int pad;
+  } __attribute__((aligned(8)));
+
+  // With snapshots on, a publisher thread periodically copies every stat, its
+  // shards summed, to a snapshot under a seqlock, followed by the counters.
+  // Readers get coherent values of a whole stat and writers are never held up.
+  struct Snapshot {
+    uint64_t seq;     // odd while the copy is being written
+    uint64_t time_ns; // CLOCK_MONOTONIC time of the copy
   } __attribute__((aligned(8)));
 
+  // Copy a snapshot to values, returns -1 when it kept changing under us
+  static int readSnapshot(const Snapshot* snap, size_t counter_num,
+      size_t* values, uint64_t* time_ns);
+
+  // A sampler thread may also keep a history of some counters, summed over
+  // the shards every interval_ms, in a ring of len entries
+  struct Ring {
+    int interval_ms;
+    size_t len;
+    std::vector<size_t> counters;
+    Ring() : interval_ms(0), len(0) {}
+  };
+
+  // Readers call it every time they look at the stats
+  static void markRead(Meta* meta, uint64_t now_ns, int interval_ms);
+
+  // A reader is watching until it missed 3 of its looks, and at least
+  // kReaderTimeoutMs
+  static constexpr const uint64_t kReaderTimeoutMs = 3000;
+
   static constexpr const char* kRootDir = "/dev/shm/";
   static constexpr const char* kPrefix = ".ucommd_stats.";
   static constexpr const char* kLockPrefix = ".ucommd_lock.";
 
  public:
   StatsShm(std::string id, std::string name, size_t num_stats,
-      std::vector<std::string> counter_list);
+      std::vector<CounterDef> counter_list, size_t num_shards = 1,
+      int snapshot_ms = 0, Ring ring = Ring());
   ~StatsShm();
 
   int init();
@@ -96,6 +259,9 @@ class StatsShm {
   int allocStat(StatPtr& stat);
   int freeStat(StatPtr& stat);
 
+  // Whether a reader looked at the stats lately
+  bool watched(uint64_t now_ns) const;
+
  protected:
   enum State {
     CREATED = 0,
@@ -105,19 +271,34 @@ class StatsShm {
 
  protected:
   void* create_shm(size_t size);
+  void publish();
+  void publish_func();
+  void sample();
+  void sample_func();
 
  private:
   std::string id_;
   std::string name_;
   size_t num_counters_;
   size_t num_stats_;
-  std::vector<std::string> counter_list_;
+  size_t num_shards_;
+  int snapshot_ms_;
+  Ring ring_;
+  std::vector<CounterDef> counter_list_;
 
   std::string shm_;
   Meta  meta_safe_;
   Meta* meta_;
   Desc* desc_;
   Counter* stats_;
+  char* snaps_;
+  char* ring_entries_;
+
+  std::thread publisher_;
+  std::thread sampler_;
+  std::mutex publisher_mutex_;
+  std::condition_variable publisher_cv_;
+  bool publisher_stop_ = false; // also stops the sampler
 
   std::unordered_set<StatPtr> stats_group_;
   std::queue<int> stats_available_;
@@ -12,17 +12,141 @@ namespace ucommd {
 
 void tryGenVTopo();
 
+// With SICL_UCOMMD_STATS_GATE on (off by default), the costly counters, those
+// updated per completion and the histograms, are only recorded while a reader
+// like sicl_monitor looks at the stats. The others are always recorded.
+extern std::atomic<bool> unet_stats_detailed_;
+
+inline bool unetStatsDetailed() {
+  return unet_stats_detailed_.load(std::memory_order_relaxed);
+}
+
+#define UNET_IB_COUNTERS(X, H) \
+  X(UNET_PID,                  "pid")               \
+  X(UNET_RANK,                 "rank")              \
+  X(UNET_IB_CQ_COUNT,          "cq_count")          \
+  X(UNET_IB_QP_COUNT,          "qp_count")          \
+  X(UNET_IB_MR_COUNT,          "mr_count")          \
+  X(UNET_IB_CPL_COUNT,         "cpl_count")         \
+  X(UNET_IB_CPL_ERR_COUNT,     "cpl_err_count")     \
+  X(UNET_IB_FIFO_POST_COUNT,   "fifo_post_count")   \
+  X(UNET_IB_FIFO_RECV_COUNT,   "fifo_recv_count")   \
+  X(UNET_IB_TX_BYTES,          "tx_bytes")          \
+  X(UNET_IB_QP_POLICY,         "qp_policy")         \
+  X(UNET_IB_QP_BUDGET,         "qp_budget")         \
+  X(UNET_IB_CTRL_HUGE_BYTES,   "ctrl_huge_bytes")   \
+  X(UNET_IB_CTRL_SMALL_BYTES,  "ctrl_small_bytes")  \
+  X(UNET_IB_FLUSH_READS,       "flush_reads")       \
+  X(UNET_IB_FLUSH_SAVED,       "flush_saved")       \
+  X(UNET_IB_LAT_MSGS,          "lat_msgs")          \
+  X(UNET_IB_LAT_BYTES,         "lat_bytes")         \
+  X(UNET_IB_BULK_MSGS,         "bulk_msgs")         \
+  X(UNET_IB_BULK_BYTES,        "bulk_bytes")        \
+  X(UNET_IB_CTS_DEFERRED,      "cts_deferred")      \
+  X(UNET_IB_CTS_WAIT_US,       "cts_wait_us")       \
+  X(UNET_IB_CTS_GRANTED_BYTES, "cts_granted_bytes") \
+  X(UNET_IB_PACE_THROTTLED,    "pace_throttled")    \
+  H(UNET_IB_SEND_SIZE,         "send_size")         \
+  H(UNET_IB_REQ_LAT_NS,        "req_lat_ns")        \
+  H(UNET_IB_CTS_LATE_NS,       "cts_late_ns")       \
+  H(UNET_IB_DATA_LATE_NS,      "data_late_ns")
+UCOMMD_COUNTER_SCHEMA(UnetIbCounter, UNET_IB_COUNTERS)
+
+// Fixed head of the bw stats, followed by an open addressed table of
+// peer_cap peers: UNET_BW_PEER_COUNTERS counters per peer, its key (rank+1,
+// 0 while free), its tx and cpl bytes, then the time spent waiting on it as a
+// receiver (cts_late, from our first isend to its CTS) and as a sender
+// (data_late, from our CTS to its first data). Peers take a slot on first
+// contact, those that find the table full are counted in peer_drops.
+#define UNET_BW_COUNTERS(X, H) \
+  X(UNET_BW_PID,        "pid")        \
+  X(UNET_BW_RANK,       "rank")       \
+  X(UNET_BW_LOCAL_RANK, "local_rank") \
+  X(UNET_BW_WORLD_SIZE, "world_size") \
+  X(UNET_BW_LOCAL_SIZE, "local_size") \
+  X(UNET_BW_PEER_CAP,   "peer_cap")   \
+  X(UNET_BW_PEER_NUM,   "peer_num")   \
+  X(UNET_BW_PEER_DROPS, "peer_drops")
+UCOMMD_COUNTER_SCHEMA(UnetBwCounter, UNET_BW_COUNTERS)
+
 enum {
-  UNET_PID = 0, UNET_RANK,
-  UNET_IB_CQ_COUNT, UNET_IB_QP_COUNT, UNET_IB_MR_COUNT,
-  UNET_IB_CPL_COUNT, UNET_IB_CPL_ERR_COUNT,
-  UNET_IB_FIFO_POST_COUNT, UNET_IB_FIFO_RECV_COUNT,
-  UNET_IB_TX_BYTES,
+  UNET_BW_PEER_KEY = 0,
+  UNET_BW_PEER_POST_BYTES,
+  UNET_BW_PEER_CPL_BYTES,
+  UNET_BW_PEER_CTS_LATE_NS,
+  UNET_BW_PEER_DATA_LATE_NS,
+  UNET_BW_PEER_COUNTERS
 };
-int UNET_BW_POST_BYTES_BY_RANK(int rank);
-int UNET_BW_CPL_BYTES_BY_RANK(int rank);
+
+inline size_t UNET_BW_PEER(size_t slot) {
+  return UnetBwCounterNum + slot * UNET_BW_PEER_COUNTERS;
+}
+
+// Counters of peer rank in the bw stats, -1 when there is no room for it
+int getUnetBwPeer(int rank);
+
+inline size_t UNET_BW_POST_BYTES(int peer) {
+  return peer + UNET_BW_PEER_POST_BYTES;
+}
+
+inline size_t UNET_BW_CPL_BYTES(int peer) {
+  return peer + UNET_BW_PEER_CPL_BYTES;
+}
+
+inline size_t UNET_BW_CTS_LATE_NS(int peer) {
+  return peer + UNET_BW_PEER_CTS_LATE_NS;
+}
+
+inline size_t UNET_BW_DATA_LATE_NS(int peer) {
+  return peer + UNET_BW_PEER_DATA_LATE_NS;
+}
+
+// One rail stat per local IB device, its dev being the device index, with the
+// live QPs and what was posted on them
+#define UNET_RAIL_COUNTERS(X, H) \
+  X(UNET_RAIL_PID,      "pid")      \
+  X(UNET_RAIL_RANK,     "rank")     \
+  X(UNET_RAIL_DEV,      "dev")      \
+  X(UNET_RAIL_QP_COUNT, "qp_count") \
+  X(UNET_RAIL_TX_BYTES, "tx_bytes") \
+  X(UNET_RAIL_TX_WRS,   "tx_wrs")
+UCOMMD_COUNTER_SCHEMA(UnetRailCounter, UNET_RAIL_COUNTERS)
+
+// One QP stat per connected send QP, when SICL_UCOMMD_STATS_QPS is set
+#define UNET_QP_COUNTERS(X, H) \
+  X(UNET_QP_PID,      "pid")      \
+  X(UNET_QP_RANK,     "rank")     \
+  X(UNET_QP_DEV,      "dev")      \
+  X(UNET_QP_PEER,     "peer")     \
+  X(UNET_QP_QPN,      "qpn")      \
+  X(UNET_QP_TX_BYTES, "tx_bytes") \
+  X(UNET_QP_TX_WRS,   "tx_wrs")
+UCOMMD_COUNTER_SCHEMA(UnetQpCounter, UNET_QP_COUNTERS)
+
+// Post to completion latency of the requests to a peer over a net device, one
+// stat per peer and device for the first SICL_UCOMMD_STATS_LAT_PEERS of them
+#define UNET_LAT_COUNTERS(X, H) \
+  X(UNET_LAT_PID,     "pid")         \
+  X(UNET_LAT_RANK,    "rank")        \
+  X(UNET_LAT_PEER,    "peer")        \
+  X(UNET_LAT_DEV,     "dev")         \
+  H(UNET_LAT_SEND_NS, "send_lat_ns") \
+  H(UNET_LAT_RECV_NS, "recv_lat_ns")
+UCOMMD_COUNTER_SCHEMA(UnetLatCounter, UNET_LAT_COUNTERS)
 
 StatPtr getUnetIbStat();
 StatPtr getUnetBwStat();
 
+// Rail stat of local IB device dev, nullptr when out of stats
+StatPtr getUnetRailStat(int dev);
+
+// QP stats are taken and given back as QPs come and go, nullptr when they are
+// off or all taken
+Stat* allocUnetQpStat(int dev, int peer, int qpn);
+void freeUnetQpStat(Stat* stat);
+
+// Latency stat of peer rank over net device dev, shared by the comms to it
+// and kept until exit, nullptr when they are off or all taken
+Stat* getUnetLatStat(int peer, int dev);
+
 } // namespace ucommd
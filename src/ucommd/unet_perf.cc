@@ -18,9 +18,14 @@
 #include <sys/file.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
 
+#include <map>
 #include <vector>
 #include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 
@@ -29,6 +34,8 @@
 
 namespace ucommd {
 
+std::atomic<bool> unet_stats_detailed_{true};
+
 class UnetPerfMonitor {
  protected:
   enum State {
@@ -38,26 +45,22 @@ class UnetPerfMonitor {
   };
 
  public:
-  static constexpr const char* kUnetPid = "pid";
-  static constexpr const char* kUnetRank = "rank";
-  static constexpr const char* kUnetLocalRank = "local_rank";
-  static constexpr const char* kUnetWorldSize = "world_size";
-  static constexpr const char* kUnetLocalSize = "local_size";
-
   static constexpr const char* kUnetIbStats = "unet_ib_stats";
   static constexpr const size_t kUnetIbStatsNum = 1;
-  static constexpr const char* kUnetIbCqCount = "cq_count";
-  static constexpr const char* kUnetIbQpCount = "qp_count";
-  static constexpr const char* kUnetIbMrCount = "mr_count";
-  static constexpr const char* kUnetIbCplCount = "cpl_count";
-  static constexpr const char* kUnetIbCplErrCount = "cpl_err_count";
-  static constexpr const char* kUnetIbFifoPostCount = "fifo_post_count";
-  static constexpr const char* kUnetIbFifoRecvCount = "fifo_recv_count";
-  static constexpr const char* kUnetIbTxBytes = "tx_bytes";
 
   static constexpr const char* kUnetBwStats = "unet_bw_stats";
   static constexpr const size_t kUnetBwStatsNum = 1;
 
+  static constexpr const char* kUnetRailStats = "unet_rail_stats";
+  static constexpr const size_t kUnetRailStatsNum = 32; // MAX_IB_DEVS
+
+  static constexpr const char* kUnetQpStats = "unet_qp_stats";
+
+  static constexpr const char* kUnetLatStats = "unet_lat_stats";
+
+  // Period the watcher checks for readers at
+  static constexpr const int kWatchMs = 100;
+
  private:
   int pid_ = -1;
   std::string proc_name_;
@@ -70,18 +73,45 @@ class UnetPerfMonitor {
   int world_size_ = -1;
   int local_size_ = -1;
 
+  // Counter shards per stat, SICL_UCOMMD_STATS_SHARDS, 1 for a single copy
+  size_t num_shards_ = 8;
+  // Period of the coherent snapshots, SICL_UCOMMD_STATS_SNAPSHOT_MS, 0 for none
+  int snapshot_ms_ = 0;
+  // History of the always recorded ib counters, taken every
+  // SICL_UCOMMD_STATS_RING_MS (0 for none, the default) in a ring of
+  // SICL_UCOMMD_STATS_RING_LEN
+  int ring_ms_ = 0;
+  size_t ring_len_ = 1024;
+  // Slots of the peer table, SICL_UCOMMD_STATS_PEERS, a power of two
+  size_t peer_cap_ = 512;
+  // QP stats, SICL_UCOMMD_STATS_QPS, 0 for none
+  size_t num_qps_ = 0;
+  // Latency stats, SICL_UCOMMD_STATS_LAT_PEERS, 0 for none
+  size_t num_lats_ = 64;
+
   std::string id_{"_"};
   StatsShmPtr shm_unet_ib_{nullptr};
   StatsShmPtr shm_unet_bw_{nullptr};
   StatPtr ib_stat_{nullptr};
   StatPtr bw_stat_{nullptr};
+  StatsShmPtr shm_unet_rail_{nullptr};
+  StatsShmPtr shm_unet_qp_{nullptr};
+  StatPtr rail_stat_[kUnetRailStatsNum];
+  std::unordered_map<Stat*, StatPtr> qp_stats_;
+  StatsShmPtr shm_unet_lat_{nullptr};
+  std::map<std::pair<int, int>, StatPtr> lat_stats_;
+
+  // Record the detailed counters only while a reader looks,
+  // SICL_UCOMMD_STATS_GATE, off by default
+  bool gate_ = false;
+  std::thread watcher_;
+  std::mutex watcher_mutex_;
+  std::condition_variable watcher_cv_;
+  bool watcher_stop_ = false;
 
   std::mutex mutex_;
   std::atomic<State> state_;
 
- public:
-  static int bw_offset_;
-
  public:
   UnetPerfMonitor() : state_(CREATED) {
     const char* disable = getenv("SICL_UCOMMD_STATS_DISABLE");
@@ -120,9 +150,83 @@ class UnetPerfMonitor {
     local_rank_ = get_from_env("LOCAL_RANK", "OMPI_COMM_WORLD_LOCAL_RANK");
     world_size_ = get_from_env("WORLD_SIZE", "OMPI_COMM_WORLD_SIZE");
     local_size_ = get_from_env("LOCAL_WORLD_SIZE", "OMPI_COMM_WORLD_LOCAL_SIZE");
+
+    const char* shards = getenv("SICL_UCOMMD_STATS_SHARDS");
+    if (shards && shards[0]) {
+      num_shards_ = std::min(std::max(atoi(shards), 1), 64);
+    }
+    const char* peers = getenv("SICL_UCOMMD_STATS_PEERS");
+    if (peers && peers[0]) {
+      peer_cap_ = std::min(std::max(atoi(peers), 1), 1 << 20);
+    }
+    // No more slots than ranks, rounded up for the hash
+    if (world_size_ > 0) peer_cap_ = std::min(peer_cap_, (size_t)world_size_);
+    size_t cap = 1;
+    while (cap < peer_cap_) cap <<= 1;
+    peer_cap_ = cap;
+
+    const char* qps = getenv("SICL_UCOMMD_STATS_QPS");
+    if (qps && qps[0]) {
+      num_qps_ = std::min(std::max(atoi(qps), 0), 1 << 16);
+    }
+
+    const char* lats = getenv("SICL_UCOMMD_STATS_LAT_PEERS");
+    if (lats && lats[0]) {
+      num_lats_ = std::min(std::max(atoi(lats), 0), 1 << 16);
+    }
+
+    const char* gate = getenv("SICL_UCOMMD_STATS_GATE");
+    if (gate && gate[0]) {
+      gate_ = gate[0] > '0';
+    }
+
+    const char* ring_ms = getenv("SICL_UCOMMD_STATS_RING_MS");
+    if (ring_ms && ring_ms[0]) {
+      ring_ms_ = std::max(atoi(ring_ms), 0);
+    }
+    const char* ring_len = getenv("SICL_UCOMMD_STATS_RING_LEN");
+    if (ring_len && ring_len[0]) {
+      ring_len_ = std::min(std::max(atoi(ring_len), 0), 1 << 20);
+    }
+
+    const char* snapshot = getenv("SICL_UCOMMD_STATS_SNAPSHOT_MS");
+    if (snapshot && snapshot[0]) {
+      snapshot_ms_ = std::max(atoi(snapshot), 0);
+    }
   }
 
   ~UnetPerfMonitor() {
+    if (watcher_.joinable()) {
+      {
+        std::unique_lock<std::mutex> lock(watcher_mutex_);
+        watcher_stop_ = true;
+      }
+      watcher_cv_.notify_all();
+      watcher_.join();
+    }
+    for (auto& lat : lat_stats_) {
+      if (lat.second) (void)shm_unet_lat_->freeStat(lat.second);
+    }
+    lat_stats_.clear();
+    if (shm_unet_lat_) {
+      shm_unet_lat_.reset();
+    }
+    for (auto& qp : qp_stats_) {
+      (void)shm_unet_qp_->freeStat(qp.second);
+    }
+    qp_stats_.clear();
+    for (auto& rail : rail_stat_) {
+      if (rail) {
+        (void)shm_unet_rail_->freeStat(rail);
+        rail.reset();
+      }
+    }
+    if (shm_unet_qp_) {
+      shm_unet_qp_.reset();
+    }
+    if (shm_unet_rail_) {
+      shm_unet_rail_.reset();
+    }
     if (bw_stat_) {
       (void)shm_unet_bw_->freeStat(bw_stat_);
       bw_stat_.reset();
@@ -175,15 +279,15 @@ class UnetPerfMonitor {
     lock_fd_ = fd;
 
     {
-      std::vector<std::string> counter_list = {
-          kUnetPid, kUnetRank,
-          kUnetIbCqCount, kUnetIbQpCount, kUnetIbMrCount,
-          kUnetIbCplCount, kUnetIbCplErrCount,
-          kUnetIbFifoPostCount, kUnetIbFifoRecvCount,
-          kUnetIbTxBytes,
-      };
+      auto counter_list = UnetIbCounterDefs();
+      StatsShm::Ring ring;
+      ring.interval_ms = ring_ms_;
+      ring.len = ring_len_;
+      ring.counters = {UNET_IB_TX_BYTES, UNET_IB_LAT_MSGS, UNET_IB_BULK_MSGS,
+          UNET_IB_FIFO_POST_COUNT, UNET_IB_FIFO_RECV_COUNT, UNET_IB_CTS_DEFERRED,
+          UNET_IB_PACE_THROTTLED};
       shm_unet_ib_ = std::make_shared<StatsShm>(id_,
-          kUnetIbStats, kUnetIbStatsNum, counter_list);
+          kUnetIbStats, kUnetIbStatsNum, counter_list, num_shards_, snapshot_ms_, ring);
       if (shm_unet_ib_->init()) {
         LogWarn("ucommd: unable to initialize unet perf monitor, failed to "
             "set up ib stats");
@@ -211,18 +315,16 @@ class UnetPerfMonitor {
     }
 
     if (rank_ >= 0) {
-      std::vector<std::string> counter_list = {
-          kUnetPid,
-          kUnetRank, kUnetLocalRank,
-          kUnetWorldSize, kUnetLocalSize,
-      };
-      bw_offset_ = counter_list.size();
-      for (int i = 0; i < world_size_; i++) {
-        counter_list.push_back("tx_rank" + std::to_string(i));
-        counter_list.push_back("cpl_rank" + std::to_string(i));
+      auto counter_list = UnetBwCounterDefs();
+      for (size_t i = 0; i < peer_cap_; i++) {
+        counter_list.push_back("peer" + std::to_string(i));
+        counter_list.push_back("tx_peer" + std::to_string(i));
+        counter_list.push_back("cpl_peer" + std::to_string(i));
+        counter_list.push_back("cts_late_peer" + std::to_string(i));
+        counter_list.push_back("data_late_peer" + std::to_string(i));
       }
       shm_unet_bw_ = std::make_shared<StatsShm>(id_,
-          kUnetBwStats, kUnetBwStatsNum, counter_list);
+          kUnetBwStats, kUnetBwStatsNum, counter_list, num_shards_, snapshot_ms_);
       if (shm_unet_bw_->init()) {
         LogWarn("ucommd: unable to initialize unet perf monitor, failed to "
             "set up bw stats");
@@ -235,9 +337,10 @@ class UnetPerfMonitor {
         state_.store(ERROR);
         return -1;
       }
-      if (bw_stat_->set(kUnetPid, pid_) ||
-          bw_stat_->set(kUnetRank, rank_) || bw_stat_->set(kUnetLocalRank, local_rank_) ||
-          bw_stat_->set(kUnetWorldSize, world_size_) || bw_stat_->set(kUnetLocalSize, local_size_)) {
+      if (bw_stat_->set(UNET_BW_PID, pid_) ||
+          bw_stat_->set(UNET_BW_RANK, rank_) || bw_stat_->set(UNET_BW_LOCAL_RANK, local_rank_) ||
+          bw_stat_->set(UNET_BW_WORLD_SIZE, world_size_) || bw_stat_->set(UNET_BW_LOCAL_SIZE, local_size_) ||
+          bw_stat_->set(UNET_BW_PEER_CAP, peer_cap_)) {
         LogWarn("ucommd: unable to initialize unet perf monitor, failed to "
             "set ranking info for bw stat");
         state_.store(ERROR);
@@ -245,31 +348,162 @@ class UnetPerfMonitor {
       }
     }
 
+    {
+      shm_unet_rail_ = std::make_shared<StatsShm>(id_,
+          kUnetRailStats, kUnetRailStatsNum, UnetRailCounterDefs(), num_shards_, snapshot_ms_);
+      if (shm_unet_rail_->init()) {
+        LogWarn("ucommd: unable to initialize unet perf monitor, failed to "
+            "set up rail stats");
+        state_.store(ERROR);
+        return -1;
+      }
+    }
+
+    if (num_qps_ > 0) {
+      shm_unet_qp_ = std::make_shared<StatsShm>(id_,
+          kUnetQpStats, num_qps_, UnetQpCounterDefs(), num_shards_, snapshot_ms_);
+      if (shm_unet_qp_->init()) {
+        LogWarn("ucommd: unable to initialize unet perf monitor, failed to "
+            "set up qp stats");
+        state_.store(ERROR);
+        return -1;
+      }
+    }
+
+    if (num_lats_ > 0) {
+      // Histograms of a peer are recorded by the thread progressing its
+      // comms, a single shard is enough and keeps the block small
+      shm_unet_lat_ = std::make_shared<StatsShm>(id_,
+          kUnetLatStats, num_lats_, UnetLatCounterDefs(), 1, snapshot_ms_);
+      if (shm_unet_lat_->init()) {
+        LogWarn("ucommd: unable to initialize unet perf monitor, failed to "
+            "set up lat stats");
+        state_.store(ERROR);
+        return -1;
+      }
+    }
+
+    if (gate_) {
+      unet_stats_detailed_.store(false, std::memory_order_relaxed);
+      watcher_ = std::thread(&UnetPerfMonitor::watch_func, this);
+    }
+
     state_.store(INITIALIZED);
     return 0;
   }
 
+  void watch_func() {
+    std::unique_lock<std::mutex> lock(watcher_mutex_);
+    while (!watcher_stop_) {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      uint64_t now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+      bool watched = false;
+      for (auto& shm : {shm_unet_ib_, shm_unet_bw_, shm_unet_rail_, shm_unet_qp_, shm_unet_lat_}) {
+        if (shm && shm->watched(now)) watched = true;
+      }
+      if (watched != unet_stats_detailed_.load(std::memory_order_relaxed)) {
+        LogInfo("ucommd: %s detailed unet stats, %s", watched ? "recording" : "no longer recording",
+            watched ? "a reader is watching" : "no reader is watching");
+        unet_stats_detailed_.store(watched, std::memory_order_relaxed);
+      }
+      watcher_cv_.wait_for(lock, std::chrono::milliseconds(kWatchMs));
+    }
+  }
+
   StatPtr getIbStat() const {
     return ib_stat_; }
 
   StatPtr getBwStat() const {
     return bw_stat_; }
 
-};
-int UnetPerfMonitor::bw_offset_ = 5;
+  int getBwPeer(int rank) {
+    if (!bw_stat_ || rank < 0) return -1;
+    size_t key = (size_t)rank + 1;
+    size_t slot = ((size_t)rank * 2654435761u) & (peer_cap_ - 1);
+    for (size_t probe = 0; probe < peer_cap_; probe++) {
+      auto peer = UNET_BW_PEER(slot);
+      auto owner = bw_stat_->claim(peer + UNET_BW_PEER_KEY, key);
+      if (owner == 0) (void)bw_stat_->inc(UNET_BW_PEER_NUM);
+      if (owner == 0 || owner == key) return peer;
+      slot = (slot + 1) & (peer_cap_ - 1);
+    }
+    (void)bw_stat_->inc(UNET_BW_PEER_DROPS);
+    return -1;
+  }
 
-int UNET_BW_POST_BYTES_BY_RANK(int rank) {
-  return UnetPerfMonitor::bw_offset_ + rank * 2;
-}
+  StatPtr getRailStat(int dev) {
+    if (dev < 0 || dev >= (int)kUnetRailStatsNum) return nullptr;
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (rail_stat_[dev]) return rail_stat_[dev];
+    StatPtr stat;
+    if (shm_unet_rail_->allocStat(stat)) return nullptr;
+    if (stat->set(UNET_RAIL_PID, pid_) || stat->set(UNET_RAIL_RANK, rank_) ||
+        stat->set(UNET_RAIL_DEV, dev)) {
+      (void)shm_unet_rail_->freeStat(stat);
+      return nullptr;
+    }
+    rail_stat_[dev] = stat;
+    return stat;
+  }
 
-int UNET_BW_CPL_BYTES_BY_RANK(int rank) {
-  return UnetPerfMonitor::bw_offset_ + rank * 2 + 1;
-}
+  Stat* allocQpStat(int dev, int peer, int qpn) {
+    if (!shm_unet_qp_) return nullptr;
+    std::unique_lock<std::mutex> lock(mutex_);
+    StatPtr stat;
+    if (shm_unet_qp_->allocStat(stat)) return nullptr;
+    if (stat->set(UNET_QP_PID, pid_) || stat->set(UNET_QP_RANK, rank_) ||
+        stat->set(UNET_QP_DEV, dev) || stat->set(UNET_QP_PEER, peer) ||
+        stat->set(UNET_QP_QPN, qpn)) {
+      (void)shm_unet_qp_->freeStat(stat);
+      return nullptr;
+    }
+    qp_stats_[stat.get()] = stat;
+    return stat.get();
+  }
 
-static StatPtr get_stat_(const int n) {   // ugly 0 for ib, 1 for bw
+  Stat* getLatStat(int peer, int dev) {
+    if (!shm_unet_lat_) return nullptr;
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto key = std::make_pair(peer, dev);
+    auto it = lat_stats_.find(key);
+    if (it != lat_stats_.end()) return it->second.get();
+    // Remember the misses too, not to look for a free stat again
+    StatPtr stat;
+    if (shm_unet_lat_->allocStat(stat) == 0 &&
+        (stat->set(UNET_LAT_PID, pid_) || stat->set(UNET_LAT_RANK, rank_) ||
+         stat->set(UNET_LAT_PEER, peer) || stat->set(UNET_LAT_DEV, dev))) {
+      (void)shm_unet_lat_->freeStat(stat);
+      stat.reset();
+    }
+    lat_stats_[key] = stat;
+    return stat.get();
+  }
+
+  void freeQpStat(Stat* stat) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = qp_stats_.find(stat);
+    if (it == qp_stats_.end()) return;
+    (void)shm_unet_qp_->freeStat(it->second);
+    qp_stats_.erase(it);
+  }
+
+};
+static UnetPerfMonitor* get_perf_() {
   static UnetPerfMonitor unet_perf_;
   if (unet_perf_.init()) return nullptr;
-  return !n ? unet_perf_.getIbStat() : unet_perf_.getBwStat();
+  return &unet_perf_;
+}
+
+static StatPtr get_stat_(const int n) {   // ugly 0 for ib, 1 for bw
+  auto perf = get_perf_();
+  if (!perf) return nullptr;
+  return !n ? perf->getIbStat() : perf->getBwStat();
+}
+
+int getUnetBwPeer(int rank) {
+  auto perf = get_perf_();
+  return perf ? perf->getBwPeer(rank) : -1;
 }
 
 StatPtr getUnetIbStat() {
@@ -280,4 +514,24 @@ StatPtr getUnetBwStat() {
   return get_stat_(1);
 }
 
+StatPtr getUnetRailStat(int dev) {
+  auto perf = get_perf_();
+  return perf ? perf->getRailStat(dev) : nullptr;
+}
+
+Stat* allocUnetQpStat(int dev, int peer, int qpn) {
+  auto perf = get_perf_();
+  return perf ? perf->allocQpStat(dev, peer, qpn) : nullptr;
+}
+
+Stat* getUnetLatStat(int peer, int dev) {
+  auto perf = get_perf_();
+  return perf ? perf->getLatStat(peer, dev) : nullptr;
+}
+
+void freeUnetQpStat(Stat* stat) {
+  auto perf = get_perf_();
+  if (perf && stat) perf->freeQpStat(stat);
+}
+
 } // namespace ucommd
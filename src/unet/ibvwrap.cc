@@ -168,6 +168,13 @@ ncclResult_t wrap_ibv_set_ece(struct ibv_qp *qp, struct ibv_ece *ece, int* suppo
   IBV_INT_CHECK_RET_ERRNO_OPTIONAL(ibv_set_ece(qp, ece), 0, "ibv_set_ece", supported);
 }
 
+ncclResult_t wrap_ibv_modify_qp_rate_limit(struct ibv_qp *qp, uint32_t rateKbps, int* supported) { /*returns 0 on success, or the value of errno on failure (which indicates the failure reason)*/
+  struct ibv_qp_rate_limit_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.rate_limit = rateKbps;
+  IBV_INT_CHECK_RET_ERRNO_OPTIONAL(ibv_modify_qp_rate_limit(qp, &attr), 0, "ibv_modify_qp_rate_limit", supported);
+}
+
 ncclResult_t wrap_ibv_event_type_str(char **ret, enum ibv_event_type event) {
   *ret = (char *) ibv_event_type_str(event);
   return ncclSuccess;
@@ -10,12 +10,22 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <limits.h>
 #include <assert.h>
 
 #include <algorithm>
 
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
 #include "net.h"
 #include "ibvwrap.h"
 #include "socket.h"
@@ -31,6 +41,56 @@ static ucommd::StatPtr ib_stat_ = nullptr;
 static ucommd::StatPtr bw_stat_ = nullptr;
 static int rank_ = -1;
 
+// Requests are timestamped with the TSC when it is invariant, which is cheaper
+// than clock_gettime, and with clockNano otherwise
+static int ncclIbUseTsc = 0;
+static double ncclIbNsPerTick = 1.0;
+
+static inline uint64_t ncclIbTicks() {
+#if defined(__x86_64__)
+  if (ncclIbUseTsc) return __rdtsc();
+#endif
+  return clockNano();
+}
+
+static inline uint64_t ncclIbTicksToNs(uint64_t ticks) {
+  return ncclIbUseTsc ? (uint64_t)(ticks * ncclIbNsPerTick) : ticks;
+}
+
+// Per completion counters, histograms and the timestamps they take are only
+// recorded while someone watches, see SICL_UCOMMD_STATS_GATE
+static inline bool ncclIbStatsDetail() {
+  return ib_stat_ && ucommd::unetStatsDetailed();
+}
+
+// The TSC is calibrated over the time between ncclIbInit, which takes a
+// reference point, and the first stat that needs ticks, without sleeping
+static uint64_t ncclIbTscRefNs = 0;
+static uint64_t ncclIbTscRefTicks = 0;
+
+static void ncclIbTicksRef() {
+#if defined(__x86_64__)
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1U << 8))) return;
+  ncclIbTscRefNs = clockNano();
+  ncclIbTscRefTicks = __rdtsc();
+#endif
+}
+
+// Call before publishing ib_stat_, requests are only timestamped after
+static void ncclIbTicksInit() {
+#if defined(__x86_64__)
+  if (ncclIbTscRefTicks == 0) return;
+  uint64_t ns = clockNano() - ncclIbTscRefNs;
+  uint64_t ticks = __rdtsc() - ncclIbTscRefTicks;
+  // Too short a span to trust the ratio, keep clockNano
+  if (ns < 1000000 || ticks == 0) return;
+  ncclIbNsPerTick = (double)ns / ticks;
+  ncclIbUseTsc = 1;
+  INFO(NCCL_NET, "UNET/IBV : timestamping requests with the TSC, %.3f ticks/ns", 1.0 / ncclIbNsPerTick);
+#endif
+}
+
 #define MAXNAMESIZE 64
 static char ncclIbIfName[MAX_IF_NAME_SIZE+1];
 static union ncclSocketAddress ncclIbIfAddr;
@@ -48,7 +108,7 @@ struct ncclIbMrCache {
 };
 
 static int ncclNMergedIbDevs = -1;
-#define NCCL_IB_MAX_DEVS_PER_NIC 2
+#define NCCL_IB_MAX_DEVS_PER_NIC 4
 #define MAX_MERGED_DEV_NAME (MAXNAMESIZE*NCCL_IB_MAX_DEVS_PER_NIC)+NCCL_IB_MAX_DEVS_PER_NIC
 struct alignas(64) ncclIbMergedDev {
   int ndevs;
@@ -62,6 +122,15 @@ struct ncclIbStats {
   int fatalErrorCount;
 };
 
+// Token bucket for send pacing. Tokens are bytes and may go negative: a send is
+// admitted while tokens >= 0 and then takes its full size.
+struct ncclIbTokenBucket {
+  uint64_t rateMbps; // 0 = unlimited
+  int64_t burst;
+  int64_t tokens;
+  uint64_t last;
+};
+
 static int ncclNIbDevs = -1;
 struct alignas(64) ncclIbDev {
   pthread_mutex_t lock;
@@ -77,8 +146,16 @@ struct alignas(64) ncclIbDev {
   char* pciPath;
   int realPort;
   int maxQp;
+  int qpCount; // live QPs on this device
+  int nComms;  // live send/recv comms using this device
   struct ncclIbMrCache mrCache;
   int ar; // ADAPTIVE_ROUTING
+  int numaNode; // NUMA node local to the NIC, -1 if unknown
+  struct ncclIbDevFlush* flush; // GPU flush QP shared by the recv comms, under lock
+  int64_t ctsGranted; // bytes granted by recv comms and not received yet, see SICL_UNET_IB_CTS_PACING
+  int ctsActive;      // recv comms holding or waiting for grants
+  pthread_mutex_t paceLock;
+  struct ncclIbTokenBucket pace; // send pacing of the device, see SICL_UNET_IB_PACE_DEV_MBPS
   struct ibv_port_attr portAttr;
   struct ncclIbStats stats;
 };
@@ -86,6 +163,9 @@ struct alignas(64) ncclIbDev {
 #define MAX_IB_DEVS 32
 struct ncclIbMergedDev ncclIbMergedDevs[MAX_IB_DEVS];
 struct ncclIbDev ncclIbDevs[MAX_IB_DEVS];
+// Filled by ncclIbInit under ncclIbLock before any comm exists, read lock-free
+// after. The stats are owned by the perf monitor for the life of the process
+static ucommd::Stat* rail_stat_[MAX_IB_DEVS];
 pthread_mutex_t ncclIbLock = PTHREAD_MUTEX_INITIALIZER;
 static int ncclIbRelaxedOrderingEnabled = 0;
 
@@ -105,6 +185,40 @@ NCCL_PARAM(IbFifoTc, "IB_FIFO_TC", 0);
 NCCL_PARAM(IbAsyncEvents, "IB_RETURN_ASYNC_EVENTS", 1);
 NCCL_PARAM(IbEceEnable, "IB_ECE_ENABLE", 1);
 
+// Send pacing: cap what a device and what each QP of a send comm inject, in
+// Mbps (0 = off), with bursts of up to SICL_UNET_IB_PACE_BURST bytes. With
+// SICL_UNET_IB_PACE_HW the QP rate is set on the NIC (IBV_QP_RATE_LIMIT) when
+// it supports it, otherwise it is enforced in software like the device one.
+SICL_PARAM(UnetIbPaceDevMbps, "UNET_IB_PACE_DEV_MBPS", 0);
+SICL_PARAM(UnetIbPaceQpMbps, "UNET_IB_PACE_QP_MBPS", 0);
+SICL_PARAM(UnetIbPaceBurst, "UNET_IB_PACE_BURST", 1 << 20);
+SICL_PARAM(UnetIbPaceHw, "UNET_IB_PACE_HW", 1);
+
+static void ncclIbTokenBucketInit(struct ncclIbTokenBucket* b, uint64_t rateMbps, int64_t burst, uint64_t now) {
+  b->rateMbps = rateMbps;
+  b->burst = burst;
+  b->tokens = burst;
+  b->last = now;
+}
+
+static void ncclIbTokenBucketRefill(struct ncclIbTokenBucket* b, uint64_t now) {
+  if (now <= b->last) return;
+  // Mbps is bits per us, i.e. rate/8000 bytes per ns; a full refill takes well under a second
+  uint64_t dt = std::min(now - b->last, (uint64_t)1000000000);
+  b->tokens = std::min(b->burst, b->tokens + (int64_t)(dt * b->rateMbps / 8000));
+  b->last = now;
+}
+
+static bool ncclIbTokenBucketReady(struct ncclIbTokenBucket* b, uint64_t now) {
+  if (b->rateMbps == 0) return true;
+  ncclIbTokenBucketRefill(b, now);
+  return b->tokens >= 0;
+}
+
+static void ncclIbTokenBucketTake(struct ncclIbTokenBucket* b, int64_t bytes) {
+  if (b->rateMbps) b->tokens -= bytes;
+}
+
 static ncclResult_t ncclIbStatsInit(struct ncclIbStats* stat) {
   __atomic_store_n(&stat->fatalErrorCount, 0, __ATOMIC_RELAXED);
   return ncclSuccess;
@@ -129,65 +243,6 @@ static void ncclIbDevFatalError(struct ncclIbDev* dev) {
   ncclIbStatsFatalError(&dev->stats);
 }
 
-pthread_t ncclIbAsyncThread;
-static void* ncclIbAsyncThreadMain(void* args) {
-  struct ncclIbDev* dev = (struct ncclIbDev*)args;
-  while (1) {
-    struct ibv_async_event event;
-    if (ncclSuccess != wrap_ibv_get_async_event(dev->context, &event)) { break; }
-    char *str;
-    struct ibv_cq* cq = event.element.cq;    // only valid if CQ error
-    struct ibv_qp* qp = event.element.qp;    // only valid if QP error
-    struct ibv_srq* srq = event.element.srq; // only valid if SRQ error
-    if (ncclSuccess != wrap_ibv_event_type_str(&str, event.event_type)) { break; }
-    switch (event.event_type) {
-    case IBV_EVENT_DEVICE_FATAL:
-      // the above is device fatal error
-      WARN("UNET/IBV : %s:%d async fatal event: %s", dev->devName, dev->portNum, str);
-      ncclIbDevFatalError(dev);
-      break;
-    case IBV_EVENT_CQ_ERR:
-      // the above is a CQ fatal error
-      WARN("UNET/IBV : %s:%d async fatal event on CQ (%p): %s", dev->devName, dev->portNum, cq, str);
-      ncclIbCqFatalError(cq);
-      break;
-    case IBV_EVENT_QP_FATAL:
-    case IBV_EVENT_QP_REQ_ERR:
-    case IBV_EVENT_QP_ACCESS_ERR:
-      // the above are QP fatal errors
-      WARN("UNET/IBV : %s:%d async fatal event on QP (%p): %s", dev->devName, dev->portNum, qp, str);
-      ncclIbQpFatalError(qp);
-      break;
-    case IBV_EVENT_SRQ_ERR:
-      // SRQ are not used in NCCL
-      WARN("UNET/IBV : %s:%d async fatal event on SRQ, unused for now (%p): %s", dev->devName, dev->portNum, srq, str);
-      break;
-    case IBV_EVENT_PATH_MIG_ERR:
-    case IBV_EVENT_PORT_ERR:
-    case IBV_EVENT_PATH_MIG:
-    case IBV_EVENT_PORT_ACTIVE:
-    case IBV_EVENT_SQ_DRAINED:
-    case IBV_EVENT_LID_CHANGE:
-    case IBV_EVENT_PKEY_CHANGE:
-    case IBV_EVENT_SM_CHANGE:
-    case IBV_EVENT_QP_LAST_WQE_REACHED:
-    case IBV_EVENT_CLIENT_REREGISTER:
-    case IBV_EVENT_SRQ_LIMIT_REACHED:
-      // the above are non-fatal
-      WARN("UNET/IBV : %s:%d Got async error event: %s", dev->devName, dev->portNum, str);
-      break;
-    case IBV_EVENT_COMM_EST:
-      break;
-    default:
-      WARN("UNET/IBV : %s:%d unknown event type (%d)", dev->devName, dev->portNum, event.event_type);
-      break;
-    }
-    // acknowledgment needs to happen last to avoid user-after-free
-    if (ncclSuccess != wrap_ibv_ack_async_event(&event)) { break; }
-  }
-  return NULL;
-}
-
 static sa_family_t envIbAddrFamily(void) {
   sa_family_t family = AF_INET;
   const char* env = getenv("NCCL_IB_ADDR_FAMILY");
@@ -395,16 +450,21 @@ static ncclResult_t ncclIbGetGidIndex(struct ibv_context *context, uint8_t portN
 }
 
 SICL_PARAM(UnetDisable, "UNET_DISABLE", 0);
+SICL_PARAM(UnetIbCtrlHugepages, "UNET_IB_CTRL_HUGEPAGES", 0); // see ncclIbCtrlAlloc
 NCCL_PARAM(IbMergeVfs, "IB_MERGE_VFS", 1);
 NCCL_PARAM(IbMergeNics, "IB_MERGE_NICS", 1);
 
-static ncclResult_t ncclIbGetPciPath(char* devName, char** path, int* realPort) {
-  char devicePath[PATH_MAX];
-  snprintf(devicePath, PATH_MAX, "/sys/class/infiniband/%s/device", devName);
-  char* p = realpath(devicePath, NULL);
-  if (p == NULL) {
-    WARN("UNET/IBV : Could not find real path of %s (%s)", devName, devicePath);
+// realDevPath is the resolved /sys/class/infiniband/<devName>/device, empty if it could not be resolved
+static ncclResult_t ncclIbGetPciPath(char* devName, const char* realDevPath, char** path, int* realPort) {
+  char* p = NULL;
+  if (realDevPath[0] == '\0') {
+    WARN("UNET/IBV : Could not find real path of %s (/sys/class/infiniband/%s/device)", devName, devName);
   } else {
+    p = strdup(realDevPath);
+    if (p == NULL) {
+      WARN("UNET/IBV : Failed to duplicate path %s", realDevPath);
+      return ncclSystemError;
+    }
     // Merge multi-port NICs into the same PCI device
     p[strlen(p)-1] = '0';
     // Also merge virtual functions (VF) into the same device
@@ -457,6 +517,225 @@ static int ncclIbRelaxedOrderingCapable(void) {
   return 1;
 }
 
+// Set the port dependent attributes of dev, at init and on port events
+static void ncclIbDevSetPort(struct ncclIbDev* dev, struct ibv_port_attr* portAttr) {
+  dev->portAttr = *portAttr;
+  dev->link = portAttr->link_layer;
+  dev->speed = (portAttr->state == IBV_PORT_ACTIVE) ? ncclIbSpeed(portAttr->active_speed) * ncclIbWidth(portAttr->active_width) : 0;
+  // Enable ADAPTIVE_ROUTING by default on IB networks
+  // But allow it to be overloaded by an env parameter
+  dev->ar = (portAttr->link_layer == IBV_LINK_LAYER_INFINIBAND) ? 1 : 0;
+  if (ncclParamIbAdaptiveRouting() != -2) dev->ar = ncclParamIbAdaptiveRouting();
+}
+
+static int ncclIbGetNumaNode(const char* devName) {
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "/sys/class/infiniband/%s/device/numa_node", devName);
+  FILE* file = fopen(path, "r");
+  if (file == NULL) return -1;
+  int node = -1;
+  if (fscanf(file, "%d", &node) != 1) node = -1;
+  fclose(file);
+  return node;
+}
+
+// Add the CPUs of NUMA node to cpus, from its sysfs cpulist ("0-31,64-95")
+static void ncclIbGetNodeCpus(int node, cpu_set_t* cpus) {
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "/sys/devices/system/node/node%d/cpulist", node);
+  FILE* file = fopen(path, "r");
+  if (file == NULL) return;
+  int first, last;
+  while (fscanf(file, "%d", &first) == 1) {
+    last = first;
+    int c = fgetc(file);
+    if (c == '-') {
+      if (fscanf(file, "%d", &last) != 1) break;
+      c = fgetc(file);
+    }
+    for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, cpus);
+    if (c != ',') break;
+  }
+  fclose(file);
+}
+
+// All device contexts share a single async event thread, waiting on their async_fd through epoll
+pthread_t ncclIbAsyncThread;
+static int ncclIbAsyncEpollFd = -1;
+
+static void ncclIbAsyncPortUpdate(struct ncclIbDev* dev) {
+  struct ibv_port_attr portAttr;
+  if (ncclSuccess != wrap_ibv_query_port(dev->context, dev->portNum, &portAttr)) {
+    WARN("UNET/IBV : %s:%d Unable to query port after event", dev->devName, dev->portNum);
+    return;
+  }
+  pthread_mutex_lock(&dev->lock);
+  int oldSpeed = dev->speed;
+  ncclIbDevSetPort(dev, &portAttr);
+  pthread_mutex_unlock(&dev->lock);
+  // Keep the aggregated speed of the merged device in sync
+  int ibDevN = dev - ncclIbDevs;
+  for (int m = 0; m < ncclNMergedIbDevs; m++) {
+    struct ncclIbMergedDev* mergedDev = ncclIbMergedDevs + m;
+    for (int i = 0; i < mergedDev->ndevs; i++) {
+      if (mergedDev->devs[i] == ibDevN) __atomic_add_fetch(&mergedDev->speed, dev->speed - oldSpeed, __ATOMIC_RELAXED);
+    }
+  }
+  INFO(NCCL_NET, "UNET/IBV : %s:%d port is %s, speed %d -> %d, ar=%d", dev->devName, dev->portNum,
+      portAttr.state == IBV_PORT_ACTIVE ? "active" : "down", oldSpeed, dev->speed, dev->ar);
+}
+
+// Device of context the event is about, the first one of the context if it is not about a port
+// (portNum < 0). NULL for a port we do not use, e.g. filtered out by NCCL_IB_HCA
+static struct ncclIbDev* ncclIbAsyncEventDev(struct ibv_context* context, int portNum) {
+  for (int d = 0; d < ncclNIbDevs; d++) {
+    if (ncclIbDevs[d].context != context) continue;
+    if (portNum < 0 || ncclIbDevs[d].portNum == portNum) return ncclIbDevs + d;
+  }
+  return NULL;
+}
+
+static void ncclIbAsyncHandleEvent(struct ibv_context* context, struct ibv_async_event* event) {
+  char *str;
+  struct ibv_cq* cq = event->element.cq;    // only valid if CQ error
+  struct ibv_qp* qp = event->element.qp;    // only valid if QP error
+  struct ibv_srq* srq = event->element.srq; // only valid if SRQ error
+  int portEvent = 0;
+  switch (event->event_type) {
+  case IBV_EVENT_PORT_ERR:
+  case IBV_EVENT_PORT_ACTIVE:
+  case IBV_EVENT_LID_CHANGE:
+  case IBV_EVENT_PKEY_CHANGE:
+  case IBV_EVENT_SM_CHANGE:
+  case IBV_EVENT_CLIENT_REREGISTER:
+  case IBV_EVENT_GID_CHANGE:
+    portEvent = 1;
+    break;
+  default:
+    break;
+  }
+  struct ncclIbDev* dev = ncclIbAsyncEventDev(context, portEvent ? event->element.port_num : -1);
+  // Nothing to update for a port we do not use, the caller only acks the event
+  if (dev == NULL) return;
+  if (ncclSuccess != wrap_ibv_event_type_str(&str, event->event_type)) return;
+  switch (event->event_type) {
+  case IBV_EVENT_DEVICE_FATAL:
+    // the above is device fatal error
+    WARN("UNET/IBV : %s:%d async fatal event: %s", dev->devName, dev->portNum, str);
+    for (int d = 0; d < ncclNIbDevs; d++) {
+      if (ncclIbDevs[d].context == context) ncclIbDevFatalError(ncclIbDevs + d);
+    }
+    break;
+  case IBV_EVENT_CQ_ERR:
+    // the above is a CQ fatal error
+    WARN("UNET/IBV : %s:%d async fatal event on CQ (%p): %s", dev->devName, dev->portNum, cq, str);
+    ncclIbCqFatalError(cq);
+    break;
+  case IBV_EVENT_QP_FATAL:
+  case IBV_EVENT_QP_REQ_ERR:
+  case IBV_EVENT_QP_ACCESS_ERR:
+    // the above are QP fatal errors
+    WARN("UNET/IBV : %s:%d async fatal event on QP (%p): %s", dev->devName, dev->portNum, qp, str);
+    ncclIbQpFatalError(qp);
+    break;
+  case IBV_EVENT_SRQ_ERR:
+    // SRQ are not used in NCCL
+    WARN("UNET/IBV : %s:%d async fatal event on SRQ, unused for now (%p): %s", dev->devName, dev->portNum, srq, str);
+    break;
+  case IBV_EVENT_PORT_ERR:
+  case IBV_EVENT_PORT_ACTIVE:
+  case IBV_EVENT_LID_CHANGE:
+  case IBV_EVENT_PKEY_CHANGE:
+  case IBV_EVENT_SM_CHANGE:
+  case IBV_EVENT_CLIENT_REREGISTER:
+  case IBV_EVENT_GID_CHANGE:
+    // the above are non-fatal port events, the port state and speed may have changed
+    WARN("UNET/IBV : %s:%d Got async error event: %s", dev->devName, dev->portNum, str);
+    ncclIbAsyncPortUpdate(dev);
+    break;
+  case IBV_EVENT_PATH_MIG_ERR:
+  case IBV_EVENT_PATH_MIG:
+  case IBV_EVENT_SQ_DRAINED:
+  case IBV_EVENT_QP_LAST_WQE_REACHED:
+  case IBV_EVENT_SRQ_LIMIT_REACHED:
+    // the above are non-fatal
+    WARN("UNET/IBV : %s:%d Got async error event: %s", dev->devName, dev->portNum, str);
+    break;
+  case IBV_EVENT_COMM_EST:
+    break;
+  default:
+    WARN("UNET/IBV : %s:%d unknown event type (%d)", dev->devName, dev->portNum, event->event_type);
+    break;
+  }
+}
+
+static void* ncclIbAsyncThreadMain(void* args) {
+  struct epoll_event events[MAX_IB_DEVS];
+  while (1) {
+    int nEvents = epoll_wait(ncclIbAsyncEpollFd, events, MAX_IB_DEVS, -1);
+    if (nEvents < 0) {
+      if (errno == EINTR) continue;
+      WARN("UNET/IBV : epoll_wait on async events failed: %s", strerror(errno));
+      break;
+    }
+    for (int e = 0; e < nEvents; e++) {
+      struct ibv_context* context = (struct ibv_context*)events[e].data.ptr;
+      struct ibv_async_event event;
+      // Level triggered: one event per wakeup, the fd stays readable while more are queued.
+      // The fd is non-blocking, call verbs directly so a spurious wakeup does not WARN
+      if (ibv_get_async_event(context, &event) != 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+        WARN("UNET/IBV : ibv_get_async_event failed: %s, stop watching the device", strerror(errno));
+        epoll_ctl(ncclIbAsyncEpollFd, EPOLL_CTL_DEL, context->async_fd, NULL);
+        continue;
+      }
+      ncclIbAsyncHandleEvent(context, &event);
+      // acknowledgment needs to happen last to avoid user-after-free
+      wrap_ibv_ack_async_event(&event);
+    }
+  }
+  return NULL;
+}
+
+// Watch the contexts of all ncclIbDevs from one thread, pinned to the NUMA nodes local to the NICs
+static ncclResult_t ncclIbAsyncThreadStart() {
+  ncclIbAsyncEpollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (ncclIbAsyncEpollFd < 0) {
+    WARN("UNET/IBV : epoll_create1 failed: %s", strerror(errno));
+    return ncclSystemError;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (int d = 0; d < ncclNIbDevs; d++) {
+    if (ncclIbDevs[d].numaNode >= 0) ncclIbGetNodeCpus(ncclIbDevs[d].numaNode, &cpus);
+    int watched = 0;
+    for (int i = 0; i < d; i++) watched |= (ncclIbDevs[i].context == ncclIbDevs[d].context);
+    if (watched) continue;
+    int fd = ncclIbDevs[d].context->async_fd;
+    int flags = fcntl(fd, F_GETFL);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = ncclIbDevs[d].context;
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 || epoll_ctl(ncclIbAsyncEpollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      WARN("UNET/IBV : Unable to watch async events of %s: %s", ncclIbDevs[d].devName, strerror(errno));
+      return ncclSystemError;
+    }
+  }
+  PTHREADCHECK(pthread_create(&ncclIbAsyncThread, NULL, ncclIbAsyncThreadMain, NULL), "pthread_create");
+  ncclSetThreadName(ncclIbAsyncThread, "UNET IbvAsync");
+  // Only pin within the CPUs we are allowed to run on
+  cpu_set_t allowed;
+  if (CPU_COUNT(&cpus) && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    CPU_AND(&cpus, &cpus, &allowed);
+    if (CPU_COUNT(&cpus) && pthread_setaffinity_np(ncclIbAsyncThread, sizeof(cpus), &cpus) != 0) {
+      INFO(NCCL_NET, "UNET/IBV : Could not pin the async event thread to the NIC NUMA nodes");
+    }
+  }
+  PTHREADCHECK(pthread_detach(ncclIbAsyncThread), "pthread_detach"); // will not be pthread_join()'d
+  return ncclSuccess;
+}
+
 // Compare ncclIbDev[dev] to all stored mergedIbDevs
 static int ncclIbFindMatchingDev(int dev) {
   for (int i = 0; i < ncclNMergedIbDevs; i++) {
@@ -476,15 +755,226 @@ static int ncclIbFindMatchingDev(int dev) {
   return ncclNMergedIbDevs;
 }
 
+// Device discovery. Every device is opened and queried by its own thread, and
+// the device/port attributes and PCI paths are shared between the local ranks
+// through a cache file in /dev/shm, so only the first rank on a node pays for
+// the queries. Contexts are always opened by each rank.
+SICL_PARAM(UnetIbDiscoveryCache, "UNET_IB_DISCOVERY_CACHE", 1);
+// Seconds a cache entry is trusted for; port state after that is queried again
+SICL_PARAM(UnetIbDiscoveryCacheTtl, "UNET_IB_DISCOVERY_CACHE_TTL", 60);
+
+#define NCCL_IB_DISC_MAX_PORTS 8
+#define NCCL_IB_DISC_CACHE_MAGIC 0x554e455449424443ULL // "UNETIBDC"
+#define NCCL_IB_DISC_CACHE_VERSION 1
+
+struct ncclIbDevDiscovery {
+  char name[MAXNAMESIZE];
+  uint64_t guid;
+  int maxQp;
+  int nPorts;
+  uint32_t portValid; // bit p-1 set when port p was queried successfully
+  struct ibv_port_attr portAttr[NCCL_IB_DISC_MAX_PORTS];
+  char pciPath[PATH_MAX]; // resolved sysfs device path, unmodified
+};
+
+struct ncclIbDevCache {
+  uint64_t magic;
+  int version;
+  int nDevs;
+  int64_t time;
+  char bootId[64];
+  char hostName[64];
+  struct ncclIbDevDiscovery devs[MAX_IB_DEVS];
+};
+
+struct ncclIbDevProbe {
+  struct ibv_device* device;
+  struct ibv_context* context;
+  ncclResult_t ret;
+  int cached; // disc was filled from the discovery cache
+  int nPorts; // ports of this device in use
+  struct ncclIbDevDiscovery disc;
+};
+
+static ncclResult_t ncclIbProbeDev(struct ncclIbDevProbe* probe) {
+  if (ncclSuccess != wrap_ibv_open_device(&probe->context, probe->device) || probe->context == NULL) {
+    WARN("UNET/IBV : Unable to open device %s", probe->device->name);
+    probe->context = NULL;
+    return ncclSystemError;
+  }
+  if (probe->cached) return ncclSuccess;
+
+  struct ncclIbDevDiscovery* disc = &probe->disc;
+  snprintf(disc->name, MAXNAMESIZE, "%s", probe->device->name);
+  struct ibv_device_attr devAttr;
+  memset(&devAttr, 0, sizeof(devAttr));
+  if (ncclSuccess != wrap_ibv_query_device(probe->context, &devAttr)) {
+    WARN("UNET/IBV : Unable to query device %s", probe->device->name);
+    wrap_ibv_close_device(probe->context);
+    probe->context = NULL;
+    return ncclSystemError;
+  }
+  disc->guid = devAttr.sys_image_guid;
+  disc->maxQp = devAttr.max_qp;
+  disc->nPorts = std::min((int)devAttr.phys_port_cnt, NCCL_IB_DISC_MAX_PORTS);
+  for (int port_num = 1; port_num <= disc->nPorts; port_num++) {
+    if (ncclSuccess != wrap_ibv_query_port(probe->context, port_num, disc->portAttr+port_num-1)) {
+      WARN("UNET/IBV : Unable to query port_num %d", port_num);
+      continue;
+    }
+    disc->portValid |= 1U << (port_num-1);
+  }
+
+  char devicePath[PATH_MAX];
+  snprintf(devicePath, PATH_MAX, "/sys/class/infiniband/%s/device", probe->device->name);
+  if (realpath(devicePath, disc->pciPath) == NULL) disc->pciPath[0] = '\0';
+  return ncclSuccess;
+}
+
+static void* ncclIbProbeThreadMain(void* args) {
+  struct ncclIbDevProbe* probe = (struct ncclIbDevProbe*)args;
+  probe->ret = ncclIbProbeDev(probe);
+  return NULL;
+}
+
+static void ncclIbDevCachePath(char* path, size_t len) {
+  snprintf(path, len, "/dev/shm/.unet_ib_devs.%u", (unsigned)getuid());
+}
+
+static void ncclIbDevCacheIdentity(char* bootId, char* hostName) {
+  memset(bootId, 0, 64);
+  memset(hostName, 0, 64);
+  int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+  if (fd >= 0) {
+    ssize_t n = read(fd, bootId, 63);
+    if (n > 0 && bootId[n-1] == '\n') bootId[n-1] = '\0';
+    close(fd);
+  }
+  gethostname(hostName, 63);
+}
+
+// Fill the probes from the node cache. Returns 1 when the cache is valid for this device list.
+static int ncclIbDevCacheLoad(struct ncclIbDevProbe* probes, int nDevs) {
+  char path[PATH_MAX];
+  ncclIbDevCachePath(path, PATH_MAX);
+  int fd = open(path, O_RDONLY|O_NOFOLLOW);
+  if (fd < 0) return 0;
+
+  int valid = 0;
+  struct ncclIbDevCache* cache = NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size != sizeof(struct ncclIbDevCache)) goto exit;
+  // /dev/shm is shared by all users, only trust a cache we wrote ourselves
+  if (!S_ISREG(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 0777) != 0600) {
+    INFO(NCCL_NET, "UNET/IBV : Ignoring discovery cache %s, not a private file of uid %u", path, (unsigned)getuid());
+    goto exit;
+  }
+  if (ncclIbMalloc((void**)&cache, sizeof(struct ncclIbDevCache)) != ncclSuccess) goto exit;
+  if (read(fd, cache, sizeof(struct ncclIbDevCache)) != sizeof(struct ncclIbDevCache)) goto exit;
+
+  char bootId[64], hostName[64];
+  ncclIbDevCacheIdentity(bootId, hostName);
+  int64_t age;
+  age = time(NULL) - cache->time;
+  if (cache->magic != NCCL_IB_DISC_CACHE_MAGIC || cache->version != NCCL_IB_DISC_CACHE_VERSION ||
+      cache->nDevs != nDevs || strncmp(cache->bootId, bootId, 64) != 0 || strncmp(cache->hostName, hostName, 64) != 0 ||
+      age < 0 || age > siclParamUnetIbDiscoveryCacheTtl()) goto exit;
+  for (int d = 0; d < nDevs; d++) {
+    if (strncmp(cache->devs[d].name, probes[d].device->name, MAXNAMESIZE) != 0) goto exit;
+  }
+  for (int d = 0; d < nDevs; d++) {
+    probes[d].disc = cache->devs[d];
+    probes[d].cached = 1;
+  }
+  valid = 1;
+exit:
+  free(cache);
+  close(fd);
+  return valid;
+}
+
+// Publish the probes for the next local ranks. Failures only cost them a full discovery.
+static void ncclIbDevCacheStore(struct ncclIbDevProbe* probes, int nDevs) {
+  struct ncclIbDevCache* cache = NULL;
+  if (ncclIbMalloc((void**)&cache, sizeof(struct ncclIbDevCache)) != ncclSuccess) return;
+  cache->magic = NCCL_IB_DISC_CACHE_MAGIC;
+  cache->version = NCCL_IB_DISC_CACHE_VERSION;
+  cache->nDevs = nDevs;
+  cache->time = time(NULL);
+  ncclIbDevCacheIdentity(cache->bootId, cache->hostName);
+  for (int d = 0; d < nDevs; d++) cache->devs[d] = probes[d].disc;
+
+  // Write a private file then rename it, readers never see a partial cache
+  char path[PATH_MAX], tmpPath[PATH_MAX+32];
+  ncclIbDevCachePath(path, PATH_MAX);
+  snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int)getpid());
+  int fd = open(tmpPath, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600);
+  if (fd >= 0 && fchmod(fd, 0600) != 0) {
+    close(fd);
+    unlink(tmpPath);
+    fd = -1;
+  }
+  if (fd < 0) {
+    INFO(NCCL_NET, "UNET/IBV : Could not create discovery cache %s", tmpPath);
+  } else {
+    ssize_t n = write(fd, cache, sizeof(struct ncclIbDevCache));
+    close(fd);
+    if (n != sizeof(struct ncclIbDevCache) || rename(tmpPath, path) != 0) {
+      INFO(NCCL_NET, "UNET/IBV : Could not publish discovery cache %s", path);
+      unlink(tmpPath);
+    }
+  }
+  free(cache);
+}
+
+static ncclResult_t ncclIbProbeDevs(struct ibv_device** devices, int nDevs, struct ncclIbDevProbe* probes) {
+  struct timeval tv0, tv1;
+  gettimeofday(&tv0, NULL);
+  for (int d = 0; d < nDevs; d++) probes[d].device = devices[d];
+
+  int useCache = siclParamUnetIbDiscoveryCache() && nDevs <= MAX_IB_DEVS;
+  int cached = useCache && ncclIbDevCacheLoad(probes, nDevs);
+
+  pthread_t* threads = NULL;
+  NCCLCHECK(ncclCalloc(&threads, nDevs));
+  for (int d = 0; d < nDevs; d++) {
+    // Fall back to probing in place if no thread can be spawned
+    if (pthread_create(threads+d, NULL, ncclIbProbeThreadMain, probes+d) != 0) {
+      threads[d] = 0;
+      probes[d].ret = ncclIbProbeDev(probes+d);
+    } else {
+      ncclSetThreadName(threads[d], "UNET IbvProbe %2d", d);
+    }
+  }
+  int allProbed = 1;
+  for (int d = 0; d < nDevs; d++) {
+    if (threads[d]) pthread_join(threads[d], NULL);
+    if (probes[d].ret != ncclSuccess) allProbed = 0;
+  }
+  free(threads);
+
+  if (useCache && !cached && allProbed) ncclIbDevCacheStore(probes, nDevs);
+  gettimeofday(&tv1, NULL);
+  INFO(NCCL_INIT|NCCL_NET, "UNET/IBV : Probed %d devices in %.2f ms (discovery cache %s)", nDevs,
+      (tv1.tv_sec - tv0.tv_sec) * 1e3 + (tv1.tv_usec - tv0.tv_usec) / 1e3, cached ? "hit" : useCache ? "miss" : "disabled");
+  return ncclSuccess;
+}
+
 ncclResult_t ncclIbInit(ncclDebugLogger_t logFunction) {
   ncclResult_t ret = ncclSuccess;
   if (siclParamUnetDisable()) return ncclInternalError;
   static int shownIbHcaEnv = 0;
+  int nIbDevs = 0;
+  struct ibv_device** devices = NULL;
+  struct ncclIbDevProbe* probes = NULL;
 
   if (ncclNIbDevs == -1) {
     pthread_mutex_lock(&ncclIbLock);
+    // Let ibv_fork_init() madvise whole hugepages when control regions live in them
+    if (siclParamUnetIbCtrlHugepages()) setenv("RDMAV_HUGEPAGES_SAFE", "1", 0);
     wrap_ibv_fork_init();
     if (ncclNIbDevs == -1) {
+      ncclIbTicksRef();
       ncclNIbDevs = 0;
       ncclNMergedIbDevs = 0;
       if (ncclFindInterfaces(ncclIbIfName, &ncclIbIfAddr, MAX_IF_NAME_SIZE, 1) != 1) {
@@ -494,9 +984,6 @@ ncclResult_t ncclIbInit(ncclDebugLogger_t logFunction) {
       }
 
       // Detect IB cards
-      int nIbDevs;
-      struct ibv_device** devices;
-
       // Check if user defined which IB device:port to use
       char* userIbEnv = getenv("NCCL_IB_HCA");
       if (userIbEnv != NULL && shownIbHcaEnv++ == 0) INFO(NCCL_NET|NCCL_ENV, "UNET/IBV : NCCL_IB_HCA set to %s", userIbEnv);
@@ -512,35 +999,27 @@ ncclResult_t ncclIbInit(ncclDebugLogger_t logFunction) {
         WARN("UNET/IBV : No ibv devices detected, check OFED driver or DevicePlugin");
       }
 
+      if (nIbDevs) {
+        NCCLCHECKGOTO(ncclCalloc(&probes, nIbDevs), ret, fail);
+        NCCLCHECKGOTO(ncclIbProbeDevs(devices, nIbDevs, probes), ret, fail);
+      }
+
       // Should NCCL merge multi-port devices into one?
       int mergeNics;
       mergeNics = ncclParamIbMergeNics();
 build_ib_list:
       for (int d=0; d<nIbDevs && ncclNIbDevs<MAX_IB_DEVS; d++) {
-        struct ibv_context * context;
-        if (ncclSuccess != wrap_ibv_open_device(&context, devices[d]) || context == NULL) {
-          WARN("UNET/IBV : Unable to open device %s", devices[d]->name);
-          continue;
-        }
-        int nPorts = 0;
-        struct ibv_device_attr devAttr;
-        memset(&devAttr, 0, sizeof(devAttr));
-        if (ncclSuccess != wrap_ibv_query_device(context, &devAttr)) {
-          WARN("UNET/IBV : Unable to query device %s", devices[d]->name);
-          if (ncclSuccess != wrap_ibv_close_device(context)) { ret = ncclInternalError; goto fail; }
-          continue;
-        }
-        for (int port_num = 1; port_num <= devAttr.phys_port_cnt; port_num++) {
+        struct ncclIbDevProbe* probe = probes + d;
+        struct ibv_context* context = probe->context;
+        if (context == NULL) continue;
+        for (int port_num = 1; port_num <= probe->disc.nPorts; port_num++) {
           // check against user specified HCAs/ports
           if (!(matchIfList(devices[d]->name, port_num, userIfs, nUserIfs, searchExact) ^ searchNot)) {
             continue;
           }
 
-          struct ibv_port_attr portAttr;
-          if (ncclSuccess != wrap_ibv_query_port(context, port_num, &portAttr)) {
-            WARN("UNET/IBV : Unable to query port_num %d", port_num);
-            continue;
-          }
+          if (!(probe->disc.portValid & (1U << (port_num-1)))) continue;
+          struct ibv_port_attr portAttr = probe->disc.portAttr[port_num-1];
           if (portAttr.state != IBV_PORT_ACTIVE) continue;
           if (portAttr.phys_state != 5) continue;
           if (portAttr.link_layer != IBV_LINK_LAYER_INFINIBAND
@@ -549,33 +1028,31 @@ build_ib_list:
 
           pthread_mutex_init(&ncclIbDevs[ncclNIbDevs].lock, NULL);
           ncclIbDevs[ncclNIbDevs].device = d;
-          ncclIbDevs[ncclNIbDevs].guid = devAttr.sys_image_guid;
-          ncclIbDevs[ncclNIbDevs].portAttr = portAttr;
+          ncclIbDevs[ncclNIbDevs].guid = probe->disc.guid;
           ncclIbDevs[ncclNIbDevs].portNum = port_num;
-          ncclIbDevs[ncclNIbDevs].link = portAttr.link_layer;
-          ncclIbDevs[ncclNIbDevs].speed = ncclIbSpeed(portAttr.active_speed) * ncclIbWidth(portAttr.active_width);
+          ncclIbDevSetPort(ncclIbDevs + ncclNIbDevs, &portAttr);
           ncclIbDevs[ncclNIbDevs].context = context;
           ncclIbDevs[ncclNIbDevs].pdRefs = 0;
           ncclIbDevs[ncclNIbDevs].pd = NULL;
           strncpy(ncclIbDevs[ncclNIbDevs].devName, devices[d]->name, MAXNAMESIZE);
-          NCCLCHECKGOTO(ncclIbGetPciPath(ncclIbDevs[ncclNIbDevs].devName, &ncclIbDevs[ncclNIbDevs].pciPath, &ncclIbDevs[ncclNIbDevs].realPort), ret, fail);
-          ncclIbDevs[ncclNIbDevs].maxQp = devAttr.max_qp;
+          NCCLCHECKGOTO(ncclIbGetPciPath(ncclIbDevs[ncclNIbDevs].devName, probe->disc.pciPath, &ncclIbDevs[ncclNIbDevs].pciPath, &ncclIbDevs[ncclNIbDevs].realPort), ret, fail);
+          ncclIbDevs[ncclNIbDevs].maxQp = probe->disc.maxQp;
+          ncclIbDevs[ncclNIbDevs].qpCount = 0;
+          ncclIbDevs[ncclNIbDevs].nComms = 0;
+          ncclIbDevs[ncclNIbDevs].flush = NULL;
+          ncclIbDevs[ncclNIbDevs].ctsGranted = 0;
+          ncclIbDevs[ncclNIbDevs].ctsActive = 0;
+          pthread_mutex_init(&ncclIbDevs[ncclNIbDevs].paceLock, NULL);
+          ncclIbTokenBucketInit(&ncclIbDevs[ncclNIbDevs].pace, siclParamUnetIbPaceDevMbps(), siclParamUnetIbPaceBurst(), clockNano());
           ncclIbDevs[ncclNIbDevs].mrCache.capacity = 0;
           ncclIbDevs[ncclNIbDevs].mrCache.population = 0;
           ncclIbDevs[ncclNIbDevs].mrCache.slots = NULL;
+          ncclIbDevs[ncclNIbDevs].numaNode = ncclIbGetNumaNode(ncclIbDevs[ncclNIbDevs].devName);
           NCCLCHECK(ncclIbStatsInit(&ncclIbDevs[ncclNIbDevs].stats));
 
-          // Enable ADAPTIVE_ROUTING by default on IB networks
-          // But allow it to be overloaded by an env parameter
-          ncclIbDevs[ncclNIbDevs].ar = (portAttr.link_layer == IBV_LINK_LAYER_INFINIBAND) ? 1 : 0;
-          if (ncclParamIbAdaptiveRouting() != -2) ncclIbDevs[ncclNIbDevs].ar = ncclParamIbAdaptiveRouting();
-
-          TRACE(NCCL_NET, "UNET/IBV : [%d] %s:%s:%d/%s speed=%d context=%p pciPath=%s ar=%d", d, devices[d]->name, devices[d]->dev_name, ncclIbDevs[ncclNIbDevs].portNum,
-              portAttr.link_layer == IBV_LINK_LAYER_INFINIBAND ? "IB" : "RoCE", ncclIbDevs[ncclNIbDevs].speed, context, ncclIbDevs[ncclNIbDevs].pciPath, ncclIbDevs[ncclNIbDevs].ar);
-
-          PTHREADCHECKGOTO(pthread_create(&ncclIbAsyncThread, NULL, ncclIbAsyncThreadMain, ncclIbDevs + ncclNIbDevs), "pthread_create", ret, fail);
-          ncclSetThreadName(ncclIbAsyncThread, "UNET IbvAsync %2d", ncclNIbDevs);
-          PTHREADCHECKGOTO(pthread_detach(ncclIbAsyncThread), "pthread_detach", ret, fail); // will not be pthread_join()'d
+          TRACE(NCCL_NET, "UNET/IBV : [%d] %s:%s:%d/%s speed=%d context=%p pciPath=%s ar=%d numa=%d", d, devices[d]->name, devices[d]->dev_name, ncclIbDevs[ncclNIbDevs].portNum,
+              portAttr.link_layer == IBV_LINK_LAYER_INFINIBAND ? "IB" : "RoCE", ncclIbDevs[ncclNIbDevs].speed, context, ncclIbDevs[ncclNIbDevs].pciPath, ncclIbDevs[ncclNIbDevs].ar,
+              ncclIbDevs[ncclNIbDevs].numaNode);
 
           int mergedDev = ncclNMergedIbDevs;
           if (mergeNics) {
@@ -601,9 +1078,8 @@ build_ib_list:
           // Aggregate speed
           ncclIbMergedDevs[mergedDev].speed += ncclIbDevs[ncclNIbDevs].speed;
           ncclNIbDevs++;
-          nPorts++;
+          probe->nPorts++;
         }
-        if (nPorts == 0 && ncclSuccess != wrap_ibv_close_device(context)) { ret = ncclInternalError; goto fail; }
       }
 
       // Detect if there are both multi-port and single-port NICs in the system. If so, disable port merging and build the list again
@@ -612,6 +1088,8 @@ build_ib_list:
           if (ncclIbMergedDevs[d].ndevs != ncclIbMergedDevs[0].ndevs) {
             INFO(NCCL_NET, "Detected a mix of single and multiple-port NICs. Force-disabling NCCL_IB_MERGE_NICS");
             mergeNics = 0;
+            for (int i = 0; i < ncclNIbDevs; i++) free(ncclIbDevs[i].pciPath);
+            for (int i = 0; i < nIbDevs; i++) probes[i].nPorts = 0;
             ncclNIbDevs = 0;
             ncclNMergedIbDevs = 0;
             memset(ncclIbMergedDevs, 0, sizeof(ncclIbMergedDevs));
@@ -620,7 +1098,21 @@ build_ib_list:
         }
       }
 
-      if (nIbDevs && (ncclSuccess != wrap_ibv_free_device_list(devices))) { ret = ncclInternalError; goto fail; };
+      // The list is final, release the devices we do not use and watch the others
+      for (int d = 0; d < nIbDevs; d++) {
+        if (probes[d].context == NULL || probes[d].nPorts != 0) continue;
+        struct ibv_context* context = probes[d].context;
+        probes[d].context = NULL;
+        if (ncclSuccess != wrap_ibv_close_device(context)) { ret = ncclInternalError; goto fail; }
+      }
+      free(probes);
+      probes = NULL;
+      if (ncclNIbDevs) NCCLCHECKGOTO(ncclIbAsyncThreadStart(), ret, fail);
+
+      struct ibv_device** deviceList;
+      deviceList = devices;
+      devices = NULL;
+      if (nIbDevs && (ncclSuccess != wrap_ibv_free_device_list(deviceList))) { ret = ncclInternalError; goto fail; };
     }
     if (ncclNIbDevs == 0) {
       INFO(NCCL_INIT|NCCL_NET, "UNET/IBV : No device found.");
@@ -652,6 +1144,7 @@ build_ib_list:
       char addrline[SOCKET_NAME_MAXLEN+1];
       INFO(NCCL_INIT|NCCL_NET, "UNET/IBV : Using%s %s; OOB %s:%s", line, ncclIbRelaxedOrderingEnabled ? "[RO]" : "",
            ncclIbIfName, ncclSocketToString(&ncclIbIfAddr, addrline));
+      for (int d = 0; d < ncclNIbDevs; d++) rail_stat_[d] = ucommd::getUnetRailStat(d).get();
     }
 
     if (rank_ < 0) {
@@ -667,6 +1160,17 @@ build_ib_list:
 exit:
   return ret;
 fail:
+  // Discovery failed half way, close what it opened and expose no device
+  if (probes) {
+    for (int i = 0; i < ncclNIbDevs; i++) free(ncclIbDevs[i].pciPath);
+    for (int d = 0; d < nIbDevs; d++) {
+      if (probes[d].context) (void)wrap_ibv_close_device(probes[d].context);
+    }
+    free(probes);
+    ncclNIbDevs = 0;
+    ncclNMergedIbDevs = 0;
+  }
+  if (devices && nIbDevs) (void)wrap_ibv_free_device_list(devices);
   pthread_mutex_unlock(&ncclIbLock);
   goto exit;
 }
@@ -740,7 +1244,15 @@ ncclResult_t ncclIbDmaBufSupport(int dev) {
   return ncclSystemError;
 }
 
+// Grouped receives per fifo slot. NCCL_NET_IB_MAX_RECVS is the default width,
+// SICL_UNET_IB_MAX_RECVS widens it up to NCCL_IB_MAX_RECVS_LIMIT.
 #define NCCL_NET_IB_MAX_RECVS 8
+#define NCCL_IB_MAX_RECVS_LIMIT 64
+SICL_PARAM(UnetIbMaxRecvs, "UNET_IB_MAX_RECVS", NCCL_NET_IB_MAX_RECVS);
+
+static int ncclIbMaxRecvs() {
+  return std::min(std::max((int)siclParamUnetIbMaxRecvs(), 1), NCCL_IB_MAX_RECVS_LIMIT);
+}
 
 ncclResult_t ncclIbGetProperties(int dev, ncclNetProperties_t* props) {
   struct ncclIbMergedDev* mergedDev = ncclIbMergedDevs+dev;
@@ -762,16 +1274,25 @@ ncclResult_t ncclIbGetProperties(int dev, ncclNetProperties_t* props) {
   props->latency = 0; // Not set
   props->port = ibDev->portNum + ibDev->realPort;
   props->maxComms = ibDev->maxQp;
-  props->maxRecvs = NCCL_NET_IB_MAX_RECVS;
+  props->maxRecvs = ncclIbMaxRecvs();
   props->netDeviceType    = NCCL_NET_DEVICE_HOST;
 //props->netDeviceVersion = NCCL_NET_DEVICE_INVALID_VERSION;
   props->netDeviceVersion = 120;
   return ncclSuccess;
 }
 
-// We need to support NCCL_NET_MAX_REQUESTS for each concurrent receive
+// We need to support NCCL_NET_MAX_REQUESTS for each concurrent receive. This is
+// the minimum and default number of requests per comm, which is also the depth
+// of the CTS fifo; SICL_UNET_IB_MAX_REQUESTS deepens both for high BDP links.
+// The receiver picks the depth and the width of the fifo and passes them to
+// the sender through the handle.
 #define MAX_REQUESTS (NCCL_NET_MAX_REQUESTS*NCCL_NET_IB_MAX_RECVS)
-static_assert(MAX_REQUESTS <= 256, "request id are encoded in wr_id and we need up to 8 requests ids per completion");
+#define NCCL_IB_MAX_REQUESTS_LIMIT 4096
+SICL_PARAM(UnetIbMaxRequests, "UNET_IB_MAX_REQUESTS", MAX_REQUESTS);
+
+static int ncclIbMaxRequests(int maxRecvs) {
+  return std::min(std::max((int)siclParamUnetIbMaxRequests(), NCCL_NET_MAX_REQUESTS*maxRecvs), NCCL_IB_MAX_REQUESTS_LIMIT);
+}
 
 #define NCCL_IB_MAX_QPS 128
 
@@ -785,6 +1306,11 @@ struct ncclIbQpInfo {
   int devIndex;
 };
 
+// Data QPs connected after the initial handshake (see SICL_UNET_IB_LAZY_QPS)
+struct ncclIbLazyQpMeta {
+  struct ncclIbQpInfo qpInfo[NCCL_IB_MAX_QPS];
+};
+
 // Per-Dev connection metadata
 struct ncclIbDevInfo {
   uint32_t lid;
@@ -812,6 +1338,11 @@ struct ncclIbConnectionMetadata {
   uint64_t fifoAddr;
   int ndevs;
   int rank;
+  int nqps;       // QPs described in qpInfo and connected right away
+  int nqpsTarget; // QPs the connection will use once lazy QPs are up
+  uint8_t devOrder[NCCL_IB_MAX_DEVS_PER_NIC]; // rail order, see ncclIbRailOrder
+  int latLane; // latQp is valid, see SICL_UNET_IB_LAT_LANE
+  struct ncclIbQpInfo latQp;
 };
 
 enum ncclIbCommState {
@@ -832,10 +1363,33 @@ struct ncclIbCommStage {
   void* comm;
 };
 
+enum ncclIbLazyState {
+  ncclIbLazyStateDone = 0,
+  ncclIbLazyStateStart = 1,
+  ncclIbLazyStateSend = 2,
+  ncclIbLazyStateRecv = 3,
+};
+
+struct ncclIbLazyStage {
+  enum ncclIbLazyState state;
+  int offset;
+  struct ncclIbLazyQpMeta* buffer;
+};
+
+// Device layout of the listener, so that the sender can plan the rail mapping
+// before it creates its QPs
+struct ncclIbRailInfo {
+  uint8_t ndevs;
+  uint8_t devOrder[NCCL_IB_MAX_DEVS_PER_NIC];
+};
+
 struct ncclIbHandle {
   union ncclSocketAddress connectAddr; // Filled by the target
   uint64_t magic; // random number to help debugging
   struct ncclIbCommStage stage; // Used by the other side when connecting
+  struct ncclIbRailInfo rails; // Filled by the target
+  uint32_t maxRequests; // Filled by the target, requests and fifo depth of the connection
+  uint32_t maxRecvs;    // Filled by the target, fifo width of the connection
 };
 
 // Retain local RoCE address for error logging
@@ -857,8 +1411,10 @@ struct ncclIbRequest {
   int peer_rank;
   struct ncclSocket* sock;
   int events[NCCL_IB_MAX_DEVS_PER_NIC];
+  uint32_t eventMask; // bit i set while events[i] > 0
   struct ncclIbNetCommDevBase* devBases[NCCL_IB_MAX_DEVS_PER_NIC];
   int nreqs;
+  uint64_t time; // of the post in ncclIbTicks, when collecting stats
   union {
     struct {
       int size;
@@ -868,12 +1424,19 @@ struct ncclIbRequest {
     } send;
     struct {
       int* sizes;
+      int64_t grant; // bytes granted to the sender, when pacing CTS
+      uint64_t ctsTime; // of the CTS post until the first data, when collecting stats
     } recv;
+    struct {
+      uint32_t waitMask; // devices with earlier flushes of the comm still in flight
+      uint64_t waitSeq[NCCL_IB_MAX_DEVS_PER_NIC];
+    } flush;
   };
 };
 
 struct ncclIbNetCommDevBase {
   int ibDevN;
+  int maxRequests; // of the comm, sizes the CQ and the QPs
   struct ibv_pd* pd;
   struct ibv_cq* cq;
   uint64_t pad[2];
@@ -882,6 +1445,9 @@ struct ncclIbNetCommDevBase {
 
 struct ncclIbListenComm {
   int dev;
+  int maxRequests;
+  int maxRecvs;
+  struct ncclIbRailInfo rails;
   struct ncclSocket sock;
   struct ncclIbCommStage stage;
 };
@@ -892,18 +1458,28 @@ struct ncclIbSendFifo {
   uint32_t rkeys[NCCL_IB_MAX_DEVS_PER_NIC];
   uint32_t nreqs;
   uint32_t tag;
+  uint32_t nqps; // QPs the sender must stripe this slot over
+  uint32_t lane; // NCCL_IB_LANE_*, the receiver posted the recv on that lane
   uint64_t idx;
-  char padding[24];
+  char padding[8];
 };
+static_assert(sizeof(struct ncclIbSendFifo) == 64, "ncclIbSendFifo must stay 64 bytes, adjust padding with NCCL_IB_MAX_DEVS_PER_NIC");
 
 struct ncclIbQp {
   struct ibv_qp* qp;
   int devIndex;
   int remDevIdx;
+  ucommd::Stat* stat; // traffic of the QP, see SICL_UCOMMD_STATS_QPS
 };
 
+// Messages and CTS either stripe over the data QPs (bulk lane) or go through a
+// single QP with its own SL/TC (latency lane), so that small messages do not
+// queue behind large writes
+#define NCCL_IB_LANE_BULK 0
+#define NCCL_IB_LANE_LAT  1
+
 struct ncclIbRemSizesFifo {
-  int elems[MAX_REQUESTS][NCCL_NET_IB_MAX_RECVS];
+  int* elems; // [maxRequests][maxRecvs], control region
   uint64_t fifoTail;
   uint64_t addr;
   uint32_t rkeys[NCCL_IB_MAX_DEVS_PER_NIC];
@@ -912,6 +1488,14 @@ struct ncclIbRemSizesFifo {
   struct ibv_sge sge;
 };
 
+// Send completions carry a tag index in wr_id, the tag lists the requests the
+// WRs belong to and lives until the completion of every QP used was polled
+struct ncclIbCplTag {
+  int refs;
+  int nreqs;
+  struct ncclIbRequest** reqs; // [maxRecvs], in cplTagReqs
+};
+
 // A per-dev struct for netIbSendComm
 struct alignas(8) ncclIbSendCommDev {
   struct ncclIbNetCommDevBase base;
@@ -926,9 +1510,14 @@ struct ncclIbMrHandle {
 struct alignas(32) ncclIbNetCommBase {
   int ndevs;
   bool isSend;
-  struct ncclIbRequest reqs[MAX_REQUESTS];
+  ucommd::Stat* latStat; // latency of the requests to the peer, see SICL_UCOMMD_STATS_LAT_PEERS
+  int maxRequests; // also the fifo depth
+  int maxRecvs;    // fifo width
+  struct ncclIbRequest* reqs; // [maxRequests]
   struct ncclIbQp qps[NCCL_IB_MAX_QPS];
   int nqps;
+  int nqpsTarget;
+  struct ncclIbLazyStage lazy;
   int qpIndex;
   int devIndex;
   struct ncclSocket sock;
@@ -936,41 +1525,56 @@ struct alignas(32) ncclIbNetCommBase {
   // Track necessary remDevInfo here
   int nRemDevs;
   struct ncclIbDevInfo remDevs[NCCL_IB_MAX_DEVS_PER_NIC];
+  // QP q runs from local device devOrder[q % ndevs] to remote device remDevOrder[q % nRemDevs]
+  uint8_t devOrder[NCCL_IB_MAX_DEVS_PER_NIC];
+  uint8_t remDevOrder[NCCL_IB_MAX_DEVS_PER_NIC];
+  // Latency lane, between the first rails of both sides
+  int latLane;
+  struct ncclIbQp latQp;
   // statistics about the comm
   struct ncclIbStats stats;
 };
 
 struct ncclIbSendComm {
   struct ncclIbNetCommBase base;
-  // Start with fifo and ibv structs as they have alignment restrictions
-  struct ncclIbSendFifo fifo[MAX_REQUESTS][NCCL_NET_IB_MAX_RECVS];
-  struct ibv_sge sges[NCCL_NET_IB_MAX_RECVS];
-  struct ibv_send_wr wrs[NCCL_NET_IB_MAX_RECVS + 1];
+  // Start with ibv structs as they have alignment restrictions
+  struct ibv_sge sges[NCCL_IB_MAX_RECVS_LIMIT];
+  struct ibv_send_wr wrs[NCCL_IB_MAX_RECVS_LIMIT + 1];
   // Each dev correlates to a mergedIbDev
   struct ncclIbSendCommDev devs[NCCL_IB_MAX_DEVS_PER_NIC];
-  struct ncclIbRequest* fifoReqs[MAX_REQUESTS][NCCL_NET_IB_MAX_RECVS];
+  struct ncclIbSendFifo* fifo; // [maxRequests][maxRecvs], control region
+  struct ncclIbRequest** fifoReqs; // [maxRequests][maxRecvs]
+  struct ncclIbCplTag* cplTags; // [maxRequests]
+  struct ncclIbRequest** cplTagReqs; // [maxRequests][maxRecvs]
+  int cplTagNext;
   struct ncclIbRemSizesFifo remSizesFifo;
   uint64_t fifoHead;
   int ar; // Use adaptive routing when all merged devices have it enabled
   int peer_rank;
+  int bwPeer; // counters of the peer in the bw stats, -1 if none
+  // First ncclIbIsend that found no CTS in the fifo, 0 if none, and the fifo
+  // entry it was last measured for, to see how late the receiver is
+  uint64_t ctsWaitTime;
+  uint64_t ctsWaitIdx;
+  // Bytes written per local and per remote device, to check the rail balance
+  uint64_t railBytes[NCCL_IB_MAX_DEVS_PER_NIC];
+  uint64_t remRailBytes[NCCL_IB_MAX_DEVS_PER_NIC];
+  // Send pacing, see SICL_UNET_IB_PACE_*
+  int pace;   // some device or QP is paced in software
+  int paceHw; // the NIC enforces the QP rate
+  struct ncclIbTokenBucket qpPace[NCCL_IB_MAX_QPS + 1]; // the last one paces the latency lane
 };
 // The SendFifo needs to be 32-byte aligned and each element needs
 // to be a 32-byte multiple, so that an entry does not get split and
-// written out of order when IB Relaxed Ordering is enabled
-static_assert((sizeof(struct ncclIbNetCommBase) % 32) == 0, "ncclIbNetCommBase size must be 32-byte multiple to ensure fifo is at proper offset");
-static_assert((offsetof(struct ncclIbSendComm, fifo) % 32) == 0, "ncclIbSendComm fifo must be 32-byte aligned");
+// written out of order when IB Relaxed Ordering is enabled. Control
+// regions are page aligned.
+static_assert((sizeof(struct ncclIbNetCommBase) % 32) == 0, "ncclIbNetCommBase size must be 32-byte multiple to ensure sges are at proper offset");
 static_assert((sizeof(struct ncclIbSendFifo) % 32) == 0, "ncclIbSendFifo element size must be 32-byte multiples");
 static_assert((offsetof(struct ncclIbSendComm, sges) % 32) == 0, "sges must be 32-byte aligned");
 static_assert((offsetof(struct ncclIbSendComm, wrs) % 32) == 0, "wrs must be 32-byte aligned");
 
-struct ncclIbGpuFlush {
-  struct ibv_mr* hostMr;
-  struct ibv_sge sge;
-  struct ncclIbQp qp;
-};
-
 struct ncclIbRemFifo {
-  struct ncclIbSendFifo elems[MAX_REQUESTS][NCCL_NET_IB_MAX_RECVS];
+  struct ncclIbSendFifo* elems; // [maxRequests][maxRecvs], control region
   uint64_t fifoTail;
   uint64_t addr;
   uint32_t flags;
@@ -978,33 +1582,286 @@ struct ncclIbRemFifo {
 
 struct alignas(16) ncclIbRecvCommDev {
   struct ncclIbNetCommDevBase base;
-  struct ncclIbGpuFlush gpuFlush;
   uint32_t fifoRkey;
   struct ibv_mr* fifoMr;
   struct ibv_sge fifoSge;
   struct ibv_mr* sizesFifoMr;
 };
 
+// A CTS held back by the receiver-side pacer
+struct ncclIbCtsDeferred {
+  struct ncclIbRequest* req;
+  int n;
+  int lane;
+  int nqps; // QPs the recv WRs were posted on, the sender must stripe the same way
+  uint64_t time;
+  // [maxRecvs] each, carved out of ctsArgs
+  void** data;
+  int* sizes;
+  int* tags;
+  void** mhandles;
+};
+
 struct ncclIbRecvComm {
   struct ncclIbNetCommBase base;
   struct ncclIbRecvCommDev devs[NCCL_IB_MAX_DEVS_PER_NIC];
   struct ncclIbRemFifo remFifo;
-  int sizesFifo[MAX_REQUESTS][NCCL_NET_IB_MAX_RECVS];
-  int gpuFlushHostMem;
-  int flushEnabled;
+  int* sizesFifo; // [maxRequests][maxRecvs], control region
+  int flushEnabled; // holds a reference on the flush QP of each device
+  int flushRetained; // devices whose flush QP reference is taken so far
+  uint32_t flushPending; // devices that delivered data since the last flush
+  uint64_t flushPosted[NCCL_IB_MAX_DEVS_PER_NIC]; // flush reads posted per device
+  uint64_t flushDone[NCCL_IB_MAX_DEVS_PER_NIC];   // and completed, updated by any poller
+  // CTS pacing: CTS are posted in order, the ones over budget wait in ctsQueue
+  struct ncclIbCtsDeferred* ctsQueue; // [maxRequests], NULL without pacing
+  void* ctsArgs; // backing store of the ctsQueue arguments
+  uint64_t ctsHead;
+  uint64_t ctsTail;
+  int64_t ctsGranted; // bytes granted and not received yet
+  int ctsActive;
+  int ctsDevN;        // ncclIbDevs entry the grants are accounted on
+  int ctsMergedDev;   // ncclIbMergedDevs entry whose aggregate speed sets the budget
+  int qpsShareComms[NCCL_IB_MAX_DEVS_PER_NIC]; // nComms of each device the QP share was computed with
   int peer_rank;
+  int bwPeer; // counters of the peer in the bw stats, -1 if none
+};
+
+#define NCCL_IB_FIFO_BYTES(base) (sizeof(struct ncclIbSendFifo)*(base)->maxRequests*(base)->maxRecvs)
+#define NCCL_IB_SIZES_FIFO_BYTES(base) (sizeof(int)*(base)->maxRequests*(base)->maxRecvs)
+#define NCCL_IB_FLUSH_BYTES sizeof(int)
+
+// Control regions are the registered host buffers of a comm (fifos, sizes
+// fifos, flush buffer). With SICL_UNET_IB_CTRL_HUGEPAGES=1 they are carved
+// out of 2MB hugepages, one MTT/IOTLB entry covering many regions, and fall
+// back to small pages when no hugepage can be mapped.
+
+#define NCCL_IB_HUGEPAGE_SIZE (2UL<<20)
+#define NCCL_IB_CTRL_UNIT 4096
+#define NCCL_IB_CTRL_UNITS (NCCL_IB_HUGEPAGE_SIZE/NCCL_IB_CTRL_UNIT)
+
+struct ncclIbCtrlChunk {
+  char* base;
+  int node;
+  uint64_t used[NCCL_IB_CTRL_UNITS/64]; // bitmap of allocated units
+  struct ncclIbCtrlChunk* next;
 };
-static_assert((offsetof(struct ncclIbRecvComm, remFifo) % 32) == 0, "ncclIbRecvComm fifo must be 32-byte aligned");
+static struct ncclIbCtrlChunk* ncclIbCtrlChunks = NULL;
+static pthread_mutex_t ncclIbCtrlLock = PTHREAD_MUTEX_INITIALIZER;
+static int ncclIbCtrlHugeFailed = 0; // no more hugepage mmap once one failed, under ncclIbCtrlLock
+
+static int ncclIbCtrlUnitUsed(struct ncclIbCtrlChunk* chunk, int u) {
+  return (chunk->used[u/64] >> (u%64)) & 1;
+}
+static void ncclIbCtrlUnitsSet(struct ncclIbCtrlChunk* chunk, int first, int n, int used) {
+  for (int u = first; u < first+n; u++) {
+    if (used) chunk->used[u/64] |= 1ULL << (u%64);
+    else chunk->used[u/64] &= ~(1ULL << (u%64));
+  }
+}
+// First fit of n free units in chunk, -1 if none
+static int ncclIbCtrlChunkFit(struct ncclIbCtrlChunk* chunk, int n) {
+  int run = 0;
+  for (int u = 0; u < (int)NCCL_IB_CTRL_UNITS; u++) {
+    run = ncclIbCtrlUnitUsed(chunk, u) ? 0 : run+1;
+    if (run == n) return u-n+1;
+  }
+  return -1;
+}
+
+static struct ncclIbCtrlChunk* ncclIbCtrlChunkCreate(int node) {
+  void* base = mmap(NULL, NCCL_IB_HUGEPAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|(21 << MAP_HUGE_SHIFT), -1, 0);
+  if (base == MAP_FAILED) {
+    ncclIbCtrlHugeFailed = 1;
+    INFO(NCCL_NET|NCCL_INIT, "UNET/IBV : No 2MB hugepage for control regions (%s), using small pages", strerror(errno));
+    return NULL;
+  }
+  if (node >= 0) ncclIbNumaBind(base, NCCL_IB_HUGEPAGE_SIZE, node);
+  // Fault the hugepage in now, so it is not lost to another process later
+  memset(base, 0, NCCL_IB_HUGEPAGE_SIZE);
+  struct ncclIbCtrlChunk* chunk;
+  if (ncclCalloc(&chunk, 1) != ncclSuccess) {
+    munmap(base, NCCL_IB_HUGEPAGE_SIZE);
+    return NULL;
+  }
+  chunk->base = (char*)base;
+  chunk->node = node;
+  chunk->next = ncclIbCtrlChunks;
+  ncclIbCtrlChunks = chunk;
+  INFO(NCCL_NET, "UNET/IBV : Mapped 2MB hugepage %p for control regions on NUMA node %d", base, ncclIbNumaNodeOf(base));
+  return chunk;
+}
+
+static ncclResult_t ncclIbCtrlAlloc(void** ptr, size_t size, int node) {
+  *ptr = NULL;
+  int n = DIVUP(size, NCCL_IB_CTRL_UNIT);
+  if (siclParamUnetIbCtrlHugepages() && n <= (int)NCCL_IB_CTRL_UNITS) {
+    pthread_mutex_lock(&ncclIbCtrlLock);
+    struct ncclIbCtrlChunk* chunk = ncclIbCtrlChunks;
+    int first = -1;
+    for (; chunk; chunk = chunk->next) {
+      if (chunk->node == node && (first = ncclIbCtrlChunkFit(chunk, n)) >= 0) break;
+    }
+    if (chunk == NULL && !ncclIbCtrlHugeFailed && (chunk = ncclIbCtrlChunkCreate(node)) != NULL) first = 0;
+    if (chunk) {
+      ncclIbCtrlUnitsSet(chunk, first, n, 1);
+      *ptr = chunk->base + first*NCCL_IB_CTRL_UNIT;
+      memset(*ptr, 0, n*NCCL_IB_CTRL_UNIT);
+    }
+    pthread_mutex_unlock(&ncclIbCtrlLock);
+    if (*ptr) {
+      if (ib_stat_) ib_stat_->add(ucommd::UNET_IB_CTRL_HUGE_BYTES, n*NCCL_IB_CTRL_UNIT);
+      return ncclSuccess;
+    }
+  }
+  int actualNode;
+  NCCLCHECK(ncclIbMallocNuma(ptr, size, node, &actualNode));
+  if (ib_stat_) ib_stat_->add(ucommd::UNET_IB_CTRL_SMALL_BYTES, ROUNDUP(size, NCCL_IB_CTRL_UNIT));
+  return ncclSuccess;
+}
+
+static void ncclIbCtrlFree(void* ptr, size_t size) {
+  if (ptr == NULL) return;
+  int n = DIVUP(size, NCCL_IB_CTRL_UNIT);
+  pthread_mutex_lock(&ncclIbCtrlLock);
+  for (struct ncclIbCtrlChunk* chunk = ncclIbCtrlChunks; chunk; chunk = chunk->next) {
+    if ((char*)ptr >= chunk->base && (char*)ptr < chunk->base + NCCL_IB_HUGEPAGE_SIZE) {
+      // Chunks stay mapped for the next comms
+      ncclIbCtrlUnitsSet(chunk, ((char*)ptr - chunk->base)/NCCL_IB_CTRL_UNIT, n, 0);
+      pthread_mutex_unlock(&ncclIbCtrlLock);
+      if (ib_stat_) ib_stat_->sub(ucommd::UNET_IB_CTRL_HUGE_BYTES, n*NCCL_IB_CTRL_UNIT);
+      return;
+    }
+  }
+  pthread_mutex_unlock(&ncclIbCtrlLock);
+  free(ptr);
+  if (ib_stat_) ib_stat_->sub(ucommd::UNET_IB_CTRL_SMALL_BYTES, n*NCCL_IB_CTRL_UNIT);
+}
+
+static void ncclIbSendCommFreeCtrl(struct ncclIbSendComm* comm) {
+  ncclIbCtrlFree(comm->fifo, NCCL_IB_FIFO_BYTES(&comm->base));
+  ncclIbCtrlFree(comm->remSizesFifo.elems, NCCL_IB_SIZES_FIFO_BYTES(&comm->base));
+  free(comm->base.reqs);
+  free(comm->fifoReqs);
+  free(comm->cplTags);
+  free(comm->cplTagReqs);
+}
+
+static void ncclIbRecvCommFreeCtrl(struct ncclIbRecvComm* comm) {
+  ncclIbCtrlFree(comm->remFifo.elems, NCCL_IB_FIFO_BYTES(&comm->base));
+  ncclIbCtrlFree(comm->sizesFifo, NCCL_IB_SIZES_FIFO_BYTES(&comm->base));
+  free(comm->base.reqs);
+  free(comm->ctsQueue);
+  free(comm->ctsArgs);
+}
 
 NCCL_PARAM(IbQpsPerConn, "IB_QPS_PER_CONNECTION", 2);
+// QPs per connection policy: 0 = fixed to NCCL_IB_QPS_PER_CONNECTION,
+// 1 = scale-aware, connections stripe over an even share of a per-device QP
+// budget, re-computed as connections come and go
+SICL_PARAM(UnetIbQpPolicy, "UNET_IB_QP_POLICY", 0);
+// QPs in use per device the NIC QP context cache is expected to hold
+SICL_PARAM(UnetIbQpBudget, "UNET_IB_QP_BUDGET", 2048);
+SICL_PARAM(UnetIbQpsPerConnMax, "UNET_IB_QPS_PER_CONNECTION_MAX", 4);
+// Only connect one QP per device at connect/accept time, and bring up the
+// remaining data QPs once the connection is actually used by an irecv
+SICL_PARAM(UnetIbLazyQps, "UNET_IB_LAZY_QPS", 0);
+
+static int ncclIbQpBudget(struct ncclIbDev* ibDev) {
+  return std::min((int)siclParamUnetIbQpBudget(), ibDev->maxQp);
+}
+
+// Number of QPs per device a new connection on mergedDev connects. With the
+// scale-aware policy it connects up to the max the NIC has room for, and only
+// stripes over its share of the budget, see ncclIbRecvQpsRebalance
+static int ncclIbQpsPerConn(struct ncclIbMergedDev* mergedDev) {
+  if (siclParamUnetIbQpPolicy() != 1) return ncclParamIbQpsPerConn();
+  int qpsPerConn = siclParamUnetIbQpsPerConnMax();
+  for (int i = 0; i < mergedDev->ndevs; i++) {
+    struct ncclIbDev* ibDev = ncclIbDevs + mergedDev->devs[i];
+    int live = __atomic_load_n(&ibDev->qpCount, __ATOMIC_RELAXED);
+    qpsPerConn = std::min(qpsPerConn, ibDev->maxQp - live);
+  }
+  return std::max(qpsPerConn, 1);
+}
+
+// QPs per device a connection on ibDev should stripe over: an even share of
+// the budget among the comms using the device
+static int ncclIbQpsShare(struct ncclIbDev* ibDev) {
+  int comms = std::max(1, __atomic_load_n(&ibDev->nComms, __ATOMIC_RELAXED));
+  int share = std::min((int)siclParamUnetIbQpsPerConnMax(), ncclIbQpBudget(ibDev) / comms);
+  return std::max(share, 1);
+}
+
+// Rail order of a merged device: fastest devices first, then by rail (port) id.
+// Both sides pair their i-th devices in this order.
+static void ncclIbRailOrder(int dev, struct ncclIbRailInfo* rails) {
+  struct ncclIbMergedDev* mergedDev = ncclIbMergedDevs + dev;
+  rails->ndevs = mergedDev->ndevs;
+  for (int i = 0; i < NCCL_IB_MAX_DEVS_PER_NIC; i++) rails->devOrder[i] = i;
+  std::stable_sort(rails->devOrder, rails->devOrder + mergedDev->ndevs, [mergedDev](uint8_t a, uint8_t b) {
+    struct ncclIbDev* devA = ncclIbDevs + mergedDev->devs[a];
+    struct ncclIbDev* devB = ncclIbDevs + mergedDev->devs[b];
+    if (devA->speed != devB->speed) return devA->speed > devB->speed;
+    return devA->realPort < devB->realPort;
+  });
+}
+
+// Local and remote device of QP q
+static void ncclIbRailMap(struct ncclIbNetCommBase* base, int q, int* devIndex, int* remDevIndex) {
+  *devIndex = base->devOrder[q % base->ndevs];
+  *remDevIndex = base->remDevOrder[q % base->nRemDevs];
+}
+
+static int ncclIbRailPeriod(struct ncclIbNetCommBase* base) {
+  int a = base->ndevs, b = base->nRemDevs;
+  while (b) { int t = a % b; a = b; b = t; }
+  return base->ndevs / a * base->nRemDevs;
+}
+
+// QP count giving every device about qpsPerDev QPs on the side with the most
+// devices, rounded to a multiple of lcm(ndevs, nRemDevs) so that each local
+// and each remote device carries the same number of QPs
+static int ncclIbRailQps(struct ncclIbNetCommBase* base, int qpsPerDev) {
+  int period = ncclIbRailPeriod(base);
+  int nqps = DIVUP(qpsPerDev * std::max(base->ndevs, base->nRemDevs), period) * period;
+  if (nqps > NCCL_IB_MAX_QPS) nqps = std::max(period, NCCL_IB_MAX_QPS - NCCL_IB_MAX_QPS % period);
+  return nqps;
+}
+
+// QPs the comm connects on local device devIndex, counting the latency lane
+static int ncclIbRailDevQps(struct ncclIbNetCommBase* base, int devIndex) {
+  int n = 1;
+  for (int q = 0; q < base->nqpsTarget; q++) {
+    if (base->devOrder[q % base->ndevs] == devIndex) n++;
+  }
+  return n;
+}
+
+static void ncclIbDoneEvent(struct ncclIbRequest* req, int devIndex) {
+  if (--req->events[devIndex] == 0) req->eventMask &= ~(1U << devIndex);
+}
 
 static void ncclIbAddEvent(struct ncclIbRequest* req, int devIndex, struct ncclIbNetCommDevBase* base) {
   req->events[devIndex]++;
+  req->eventMask |= 1U << devIndex;
+  req->devBases[devIndex] = base;
+}
+
+// Flush requests are completed by whichever thread polls the shared flush CQ
+static void ncclIbAddFlushEvent(struct ncclIbRequest* req, int devIndex, struct ncclIbNetCommDevBase* base) {
   req->devBases[devIndex] = base;
+  __atomic_add_fetch(&req->events[devIndex], 1, __ATOMIC_RELAXED);
+  __atomic_or_fetch(&req->eventMask, 1U << devIndex, __ATOMIC_RELEASE);
 }
 
-ncclResult_t ncclIbInitCommDevBase(int ibDevN, struct ncclIbNetCommDevBase* base, void* cq_context) {
+static void ncclIbDoneFlushEvent(struct ncclIbRequest* req, int devIndex) {
+  if (__atomic_sub_fetch(&req->events[devIndex], 1, __ATOMIC_ACQ_REL) == 0)
+    __atomic_and_fetch(&req->eventMask, ~(1U << devIndex), __ATOMIC_RELEASE);
+}
+
+ncclResult_t ncclIbInitCommDevBase(int ibDevN, struct ncclIbNetCommDevBase* base, int maxRequests, int nqps, void* cq_context) {
   base->ibDevN = ibDevN;
+  base->maxRequests = maxRequests;
   struct ncclIbDev* ibDev = ncclIbDevs + ibDevN;
   pthread_mutex_lock(&ibDev->lock);
   if (0 == ibDev->pdRefs++) {
@@ -1017,10 +1874,12 @@ ncclResult_t ncclIbInitCommDevBase(int ibDevN, struct ncclIbNetCommDevBase* base
     }
   }
   base->pd = ibDev->pd;
+  ibDev->nComms++;
   pthread_mutex_unlock(&ibDev->lock);
 
-  // Recv requests can generate 2 completions (one for the post FIFO, one for the Recv).
-  NCCLCHECK(wrap_ibv_create_cq(&base->cq, ibDev->context, 2*MAX_REQUESTS*ncclParamIbQpsPerConn(), cq_context, NULL, 0));
+  // Recv requests can generate 2 completions (one for the post FIFO, one for the Recv),
+  // on each of the nqps QPs of the comm on this device
+  NCCLCHECK(wrap_ibv_create_cq(&base->cq, ibDev->context, 2*maxRequests*nqps, cq_context, NULL, 0));
   if (ib_stat_) ib_stat_->inc(ucommd::UNET_IB_CQ_COUNT);
 
   return ncclSuccess;
@@ -1032,6 +1891,7 @@ ncclResult_t ncclIbDestroyBase(struct ncclIbNetCommDevBase* base) {
   if (ib_stat_) ib_stat_->dec(ucommd::UNET_IB_CQ_COUNT);
 
   pthread_mutex_lock(&ncclIbDevs[base->ibDevN].lock);
+  ncclIbDevs[base->ibDevN].nComms--;
   if (0 == --ncclIbDevs[base->ibDevN].pdRefs) {
     NCCLCHECKGOTO(wrap_ibv_dealloc_pd(ncclIbDevs[base->ibDevN].pd), res, returning);
   }
@@ -1041,21 +1901,27 @@ returning:
   return res;
 }
 
-ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbNetCommDevBase* base, int access_flags, void* qp_context, struct ncclIbQp* qp) {
+static ncclResult_t ncclIbCreateQpDepth(uint8_t ib_port, struct ncclIbNetCommDevBase* base, int access_flags, void* qp_context, int maxSendWr, int maxRecvWr, struct ncclIbQp* qp) {
   struct ibv_qp_init_attr qpInitAttr;
   memset(&qpInitAttr, 0, sizeof(struct ibv_qp_init_attr));
   qpInitAttr.qp_context = qp_context;
   qpInitAttr.send_cq = base->cq;
   qpInitAttr.recv_cq = base->cq;
   qpInitAttr.qp_type = IBV_QPT_RC;
-  // We might send 2 messages per send (RDMA and RDMA_WITH_IMM)
-  qpInitAttr.cap.max_send_wr = 2*MAX_REQUESTS;
-  qpInitAttr.cap.max_recv_wr = MAX_REQUESTS;
+  qpInitAttr.cap.max_send_wr = maxSendWr;
+  qpInitAttr.cap.max_recv_wr = maxRecvWr;
   qpInitAttr.cap.max_send_sge = 1;
   qpInitAttr.cap.max_recv_sge = 1;
   qpInitAttr.cap.max_inline_data = ncclParamIbUseInline() ? sizeof(struct ncclIbSendFifo) : 0;
   NCCLCHECK(wrap_ibv_create_qp(&qp->qp, base->pd, &qpInitAttr));
   if (ib_stat_) ib_stat_->inc(ucommd::UNET_IB_QP_COUNT);
+  if (rail_stat_[base->ibDevN]) rail_stat_[base->ibDevN]->inc(ucommd::UNET_RAIL_QP_COUNT);
+  qp->stat = NULL;
+  struct ncclIbDev* ibDev = ncclIbDevs + base->ibDevN;
+  // The scale-aware policy connects more QPs than the budget and keeps the ones in use within it
+  if (__atomic_add_fetch(&ibDev->qpCount, 1, __ATOMIC_RELAXED) == ncclIbQpBudget(ibDev) + 1 && siclParamUnetIbQpPolicy() != 1) {
+    INFO(NCCL_NET, "UNET/IBV : %s live QPs went over the budget of %d (maxQp %d)", ibDev->devName, ncclIbQpBudget(ibDev), ibDev->maxQp);
+  }
   struct ibv_qp_attr qpAttr;
   memset(&qpAttr, 0, sizeof(struct ibv_qp_attr));
   qpAttr.qp_state = IBV_QPS_INIT;
@@ -1066,7 +1932,25 @@ ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbNetCommDevBase* base,
   return ncclSuccess;
 }
 
-ncclResult_t ncclIbRtrQp(struct ibv_qp* qp, uint8_t sGidIndex, uint32_t dest_qp_num, struct ncclIbDevInfo* info, bool override_tc) {
+ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbNetCommDevBase* base, int access_flags, void* qp_context, struct ncclIbQp* qp) {
+  // We might send 2 messages per send (RDMA and RDMA_WITH_IMM)
+  return ncclIbCreateQpDepth(ib_port, base, access_flags, qp_context, 2*base->maxRequests, base->maxRequests, qp);
+}
+
+ncclResult_t ncclIbDestroyQp(struct ncclIbNetCommDevBase* base, struct ncclIbQp* qp) {
+  NCCLCHECK(wrap_ibv_destroy_qp(qp->qp));
+  qp->qp = NULL;
+  if (ib_stat_) ib_stat_->dec(ucommd::UNET_IB_QP_COUNT);
+  if (rail_stat_[base->ibDevN]) rail_stat_[base->ibDevN]->dec(ucommd::UNET_RAIL_QP_COUNT);
+  if (qp->stat) {
+    ucommd::freeUnetQpStat(qp->stat);
+    qp->stat = NULL;
+  }
+  __atomic_sub_fetch(&ncclIbDevs[base->ibDevN].qpCount, 1, __ATOMIC_RELAXED);
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclIbRtrQpAttr(struct ibv_qp* qp, uint8_t sGidIndex, uint32_t dest_qp_num, struct ncclIbDevInfo* info, uint8_t tc, uint8_t sl) {
   struct ibv_qp_attr qpAttr;
   memset(&qpAttr, 0, sizeof(struct ibv_qp_attr));
   qpAttr.qp_state = IBV_QPS_RTR;
@@ -1084,19 +1968,36 @@ ncclResult_t ncclIbRtrQp(struct ibv_qp* qp, uint8_t sGidIndex, uint32_t dest_qp_
     qpAttr.ah_attr.grh.flow_label = 0;
     qpAttr.ah_attr.grh.sgid_index = sGidIndex;
     qpAttr.ah_attr.grh.hop_limit = 255;
-    if (ncclParamIbFifoTc() && override_tc) {
-      qpAttr.ah_attr.grh.traffic_class = ncclParamIbFifoTc();
-    } else {
-      qpAttr.ah_attr.grh.traffic_class = ncclParamIbTc();
-    }
+    qpAttr.ah_attr.grh.traffic_class = tc;
   }
-  qpAttr.ah_attr.sl = ncclParamIbSl();
+  qpAttr.ah_attr.sl = sl;
   qpAttr.ah_attr.src_path_bits = 0;
   qpAttr.ah_attr.port_num = info->ib_port;
   NCCLCHECK(wrap_ibv_modify_qp(qp, &qpAttr, IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER));
   return ncclSuccess;
 }
 
+ncclResult_t ncclIbRtrQp(struct ibv_qp* qp, uint8_t sGidIndex, uint32_t dest_qp_num, struct ncclIbDevInfo* info, bool override_tc) {
+  uint8_t tc = (ncclParamIbFifoTc() && override_tc) ? ncclParamIbFifoTc() : ncclParamIbTc();
+  return ncclIbRtrQpAttr(qp, sGidIndex, dest_qp_num, info, tc, ncclParamIbSl());
+}
+
+// Latency lane: a QP per connection for CTS and messages of at most
+// SICL_UNET_IB_LAT_THRESHOLD bytes, on SICL_UNET_IB_LAT_SL/TC (default to
+// NCCL_IB_SL and NCCL_IB_FIFO_TC, or NCCL_IB_TC). Used when both sides enable it.
+SICL_PARAM(UnetIbLatLane, "UNET_IB_LAT_LANE", 0);
+SICL_PARAM(UnetIbLatSl, "UNET_IB_LAT_SL", -1);
+SICL_PARAM(UnetIbLatTc, "UNET_IB_LAT_TC", -1);
+SICL_PARAM(UnetIbLatThreshold, "UNET_IB_LAT_THRESHOLD", 16384);
+
+static ncclResult_t ncclIbRtrLatQp(struct ibv_qp* qp, uint8_t sGidIndex, uint32_t dest_qp_num, struct ncclIbDevInfo* info) {
+  int64_t tc = siclParamUnetIbLatTc();
+  if (tc < 0) tc = ncclParamIbFifoTc() ? ncclParamIbFifoTc() : ncclParamIbTc();
+  int64_t sl = siclParamUnetIbLatSl();
+  if (sl < 0) sl = ncclParamIbSl();
+  return ncclIbRtrQpAttr(qp, sGidIndex, dest_qp_num, info, tc, sl);
+}
+
 ncclResult_t ncclIbRtsQp(struct ibv_qp* qp) {
   struct ibv_qp_attr qpAttr;
   memset(&qpAttr, 0, sizeof(struct ibv_qp_attr));
@@ -1110,6 +2011,119 @@ ncclResult_t ncclIbRtsQp(struct ibv_qp* qp) {
   return ncclSuccess;
 }
 
+// GPU Direct RDMA flush, one loopback QP per device shared by all the recv comms
+// using it. Flush WRs carry the request pointer in wr_id so that whichever thread
+// polls the shared CQ can complete the request that issued them.
+struct ncclIbDevFlush {
+  int refs;
+  int depth;
+  int inflight; // WRs posted and not polled yet, bounded by depth
+  struct ncclIbNetCommDevBase base;
+  struct ncclIbQp qp;
+  struct ibv_mr* hostMr;
+  struct ibv_sge sge;
+  int* hostMem; // control region
+};
+
+// Outstanding flush WRs per device, across all the recv comms
+SICL_PARAM(UnetIbFlushQpDepth, "UNET_IB_FLUSH_QP_DEPTH", 1024);
+
+static ncclResult_t ncclIbFlushDestroy(struct ncclIbDevFlush* flush) {
+  if (flush->qp.qp != NULL) NCCLCHECK(ncclIbDestroyQp(&flush->base, &flush->qp));
+  if (flush->hostMr != NULL) NCCLCHECK(wrap_ibv_dereg_mr(flush->hostMr));
+  if (flush->base.cq != NULL) {
+    NCCLCHECK(wrap_ibv_destroy_cq(flush->base.cq));
+    if (ib_stat_) ib_stat_->dec(ucommd::UNET_IB_CQ_COUNT);
+  }
+  ncclIbCtrlFree(flush->hostMem, NCCL_IB_FLUSH_BYTES);
+  free(flush);
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclIbFlushCreate(int ibDevN, struct ncclIbGidInfo* gidInfo, struct ncclIbDevFlush** flushPtr) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclIbDev* ibDev = ncclIbDevs + ibDevN;
+  struct ncclIbDevFlush* flush = NULL;
+  struct ncclIbDevInfo devInfo;
+  NCCLCHECK(ncclCalloc(&flush, 1));
+  flush->depth = std::max(1, (int)siclParamUnetIbFlushQpDepth());
+  flush->base.ibDevN = ibDevN;
+  flush->base.pd = ibDev->pd;
+  flush->base.gidInfo = *gidInfo;
+  // Same context as the flush QP, ncclIbCqFatalError reads it on IBV_EVENT_CQ_ERR
+  NCCLCHECKGOTO(wrap_ibv_create_cq(&flush->base.cq, ibDev->context, flush->depth, &ibDev->stats, NULL, 0), ret, fail);
+  if (ib_stat_) ib_stat_->inc(ucommd::UNET_IB_CQ_COUNT);
+  NCCLCHECKGOTO(ncclIbCtrlAlloc((void**)&flush->hostMem, NCCL_IB_FLUSH_BYTES, ibDev->numaNode), ret, fail);
+  NCCLCHECKGOTO(wrap_ibv_reg_mr(&flush->hostMr, flush->base.pd, flush->hostMem, NCCL_IB_FLUSH_BYTES, IBV_ACCESS_LOCAL_WRITE), ret, fail);
+  flush->sge.addr = (uint64_t)flush->hostMem;
+  flush->sge.length = 1;
+  flush->sge.lkey = flush->hostMr->lkey;
+  NCCLCHECKGOTO(ncclIbCreateQpDepth(ibDev->portNum, &flush->base, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ, &ibDev->stats, flush->depth, 1, &flush->qp), ret, fail);
+  devInfo.lid         = ibDev->portAttr.lid;
+  devInfo.link_layer  = ibDev->portAttr.link_layer;
+  devInfo.ib_port     = ibDev->portNum;
+  devInfo.spn         = gidInfo->localGid.global.subnet_prefix;
+  devInfo.iid         = gidInfo->localGid.global.interface_id;
+  devInfo.is_global   = (ncclParamIbIsGlobal() || (ibDev->portAttr.flags & IBV_QPF_GRH_REQUIRED));
+  devInfo.mtu         = ibDev->portAttr.active_mtu;
+  NCCLCHECKGOTO(ncclIbRtrQp(flush->qp.qp, gidInfo->localGidIndex, flush->qp.qp->qp_num, &devInfo, false), ret, fail);
+  NCCLCHECKGOTO(ncclIbRtsQp(flush->qp.qp), ret, fail);
+  INFO(NCCL_NET, "UNET/IBV : %s shared flush QP %u depth %d", ibDev->devName, flush->qp.qp->qp_num, flush->depth);
+  *flushPtr = flush;
+  return ncclSuccess;
+fail:
+  ncclIbFlushDestroy(flush);
+  return ret;
+}
+
+// Take a reference on the flush QP of ibDevN, creating it for the first user.
+// The caller holds a PD reference (ncclIbInitCommDevBase) for as long as it
+// holds the flush one, so the PD outlives the flush QP and MR.
+static ncclResult_t ncclIbFlushRetain(int ibDevN, struct ncclIbGidInfo* gidInfo) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclIbDev* ibDev = ncclIbDevs + ibDevN;
+  pthread_mutex_lock(&ibDev->lock);
+  if (ibDev->flush == NULL) NCCLCHECKGOTO(ncclIbFlushCreate(ibDevN, gidInfo, &ibDev->flush), ret, exit);
+  ibDev->flush->refs++;
+exit:
+  pthread_mutex_unlock(&ibDev->lock);
+  return ret;
+}
+
+static ncclResult_t ncclIbFlushRelease(int ibDevN) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclIbDev* ibDev = ncclIbDevs + ibDevN;
+  pthread_mutex_lock(&ibDev->lock);
+  if (--ibDev->flush->refs == 0) {
+    struct ncclIbDevFlush* flush = ibDev->flush;
+    ibDev->flush = NULL;
+    NCCLCHECKGOTO(ncclIbFlushDestroy(flush), ret, exit);
+  }
+exit:
+  pthread_mutex_unlock(&ibDev->lock);
+  return ret;
+}
+
+// Comms embed the fifos, sizes and requests the NICs access, keep them on the NUMA
+// node of the NIC. SICL_UNET_IB_NUMA_NODE >= 0 forces a node (e.g. to measure the
+// cost of a remote one), -2 keeps the default allocation policy.
+SICL_PARAM(UnetIbNumaNode, "UNET_IB_NUMA_NODE", -1);
+
+static int ncclIbMergedDevNumaNode(int dev) {
+  int node = siclParamUnetIbNumaNode();
+  if (node == -1) node = ncclIbDevs[ncclIbMergedDevs[dev].devs[0]].numaNode;
+  return node < 0 ? -1 : node;
+}
+
+static ncclResult_t ncclIbAllocComm(void** comm, size_t size, int dev, const char* name) {
+  int node = ncclIbMergedDevNumaNode(dev);
+  int actualNode;
+  NCCLCHECK(ncclIbMallocNuma(comm, size, node, &actualNode));
+  INFO(NCCL_NET, "UNET/IBV : %s %p on %s placed on NUMA node %d (NIC node %d%s)", name, *comm, ncclIbMergedDevs[dev].devName,
+      actualNode, ncclIbDevs[ncclIbMergedDevs[dev].devs[0]].numaNode, siclParamUnetIbNumaNode() >= 0 ? ", forced" : "");
+  return ncclSuccess;
+}
+
 ncclResult_t ncclIbListen(int dev, void* opaqueHandle, void** listenComm) {
   ncclResult_t ret = ncclSuccess;
   struct ncclIbListenComm* comm;
@@ -1118,12 +2132,28 @@ ncclResult_t ncclIbListen(int dev, void* opaqueHandle, void** listenComm) {
   static_assert(sizeof(struct ncclIbHandle) < NCCL_NET_HANDLE_MAXSIZE, "ncclIbHandle size too large");
   memset(handle, 0, sizeof(struct ncclIbHandle));
   comm->dev = dev;
+  comm->maxRecvs = ncclIbMaxRecvs();
+  comm->maxRequests = ncclIbMaxRequests(comm->maxRecvs);
+  ncclIbRailOrder(dev, &comm->rails);
+  handle->rails = comm->rails;
+  handle->maxRequests = comm->maxRequests;
+  handle->maxRecvs = comm->maxRecvs;
   handle->magic = NCCL_SOCKET_MAGIC;
   NCCLCHECKGOTO(ncclSocketInit(&comm->sock, &ncclIbIfAddr, handle->magic, ncclSocketTypeNetIb, NULL, 1), ret, fail);
   NCCLCHECKGOTO(ncclSocketListen(&comm->sock), ret, fail);
   NCCLCHECKGOTO(ncclSocketGetAddr(&comm->sock, &handle->connectAddr), ret, fail);
   *listenComm = comm;
-  if (ib_stat_ == nullptr) ib_stat_ = ucommd::getUnetIbStat();
+  if (ib_stat_ == nullptr) {
+    ucommd::StatPtr stat = ucommd::getUnetIbStat();
+    if (stat) {
+      ncclIbTicksInit();
+      int budget = siclParamUnetIbQpBudget();
+      for (int d = 0; d < ncclNIbDevs; d++) budget = std::min(budget, ncclIbQpBudget(ncclIbDevs + d));
+      stat->set(ucommd::UNET_IB_QP_POLICY, siclParamUnetIbQpPolicy());
+      stat->set(ucommd::UNET_IB_QP_BUDGET, budget);
+    }
+    ib_stat_ = stat;
+  }
   if (bw_stat_ == nullptr) bw_stat_ = ucommd::getUnetBwStat();
 exit:
   return ret;
@@ -1133,6 +2163,40 @@ fail:
   goto exit;
 }
 
+static void ncclIbPaceInit(struct ncclIbSendComm* comm) {
+  uint64_t qpMbps = siclParamUnetIbPaceQpMbps();
+  uint64_t now = clockNano();
+  comm->paceHw = (qpMbps && siclParamUnetIbPaceHw()) ? 1 : 0;
+  for (int q = 0; q < NCCL_IB_MAX_QPS + 1; q++) {
+    ncclIbTokenBucketInit(comm->qpPace + q, comm->paceHw ? 0 : qpMbps, siclParamUnetIbPaceBurst(), now);
+  }
+  comm->pace = (qpMbps && !comm->paceHw) ? 1 : 0;
+  for (int i = 0; i < comm->base.ndevs; i++) {
+    if (ncclIbDevs[comm->devs[i].base.ibDevN].pace.rateMbps) comm->pace = 1;
+  }
+}
+
+// Set the QP rate on the NIC once the QP is RTS, switch the comm to software
+// pacing if the NIC can't
+static ncclResult_t ncclIbPaceQp(struct ncclIbSendComm* comm, struct ncclIbQp* qp) {
+  if (!comm->paceHw) return ncclSuccess;
+  uint64_t qpMbps = siclParamUnetIbPaceQpMbps();
+  int supported = 0;
+  if (wrap_ibv_modify_qp_rate_limit(qp->qp, qpMbps * 1000, &supported) != ncclSuccess || !supported) {
+    INFO(NCCL_NET, "UNET/IBV : peer rank %d QP rate limit of %lu Mbps not set on the NIC, pacing in software", comm->peer_rank, qpMbps);
+    comm->paceHw = 0;
+    comm->pace = 1;
+    for (int q = 0; q < NCCL_IB_MAX_QPS + 1; q++) comm->qpPace[q].rateMbps = qpMbps;
+  }
+  return ncclSuccess;
+}
+
+// Count the traffic of a send QP once it is connected and its peer known
+static void ncclIbQpStatInit(struct ncclIbSendComm* comm, struct ncclIbQp* qp) {
+  if (!ib_stat_ || qp->stat) return;
+  qp->stat = ucommd::allocUnetQpStat(comm->devs[qp->devIndex].base.ibDevN, comm->peer_rank, qp->qp->qp_num);
+}
+
 ncclResult_t ncclIbConnect(int dev, void* opaqueHandle, void** sendComm, ncclNetDeviceHandle_t** /*sendDevComm*/) {
   ncclResult_t ret = ncclSuccess;
   struct ncclIbHandle* handle = (struct ncclIbHandle*) opaqueHandle;
@@ -1151,7 +2215,22 @@ ncclResult_t ncclIbConnect(int dev, void* opaqueHandle, void** sendComm, ncclNet
   }
   stage->buffer = NULL;
 
-  NCCLCHECK(ncclIbMalloc((void**)&comm, sizeof(struct ncclIbSendComm)));
+  NCCLCHECK(ncclIbAllocComm((void**)&comm, sizeof(struct ncclIbSendComm), dev, "sendComm"));
+  // The fifo is written by the receiver, follow its depth
+  comm->base.maxRequests = handle->maxRequests ? handle->maxRequests : MAX_REQUESTS;
+  comm->base.maxRecvs = handle->maxRecvs ? handle->maxRecvs : NCCL_NET_IB_MAX_RECVS;
+  if (comm->base.maxRecvs > NCCL_IB_MAX_RECVS_LIMIT) {
+    WARN("UNET/IBV : peer asked for %d grouped receives, only %d are supported", comm->base.maxRecvs, NCCL_IB_MAX_RECVS_LIMIT);
+    ret = ncclInvalidUsage;
+    goto fail;
+  }
+  NCCLCHECKGOTO(ncclCalloc(&comm->base.reqs, comm->base.maxRequests), ret, fail);
+  NCCLCHECKGOTO(ncclCalloc(&comm->fifoReqs, comm->base.maxRequests*comm->base.maxRecvs), ret, fail);
+  NCCLCHECKGOTO(ncclCalloc(&comm->cplTags, comm->base.maxRequests), ret, fail);
+  NCCLCHECKGOTO(ncclCalloc(&comm->cplTagReqs, comm->base.maxRequests*comm->base.maxRecvs), ret, fail);
+  for (int t = 0; t < comm->base.maxRequests; t++) comm->cplTags[t].reqs = comm->cplTagReqs + t*comm->base.maxRecvs;
+  NCCLCHECKGOTO(ncclIbCtrlAlloc((void**)&comm->fifo, NCCL_IB_FIFO_BYTES(&comm->base), ncclIbMergedDevNumaNode(dev)), ret, fail);
+  NCCLCHECKGOTO(ncclIbCtrlAlloc((void**)&comm->remSizesFifo.elems, NCCL_IB_SIZES_FIFO_BYTES(&comm->base), ncclIbMergedDevNumaNode(dev)), ret, fail);
   NCCLCHECKGOTO(ncclIbStatsInit(&comm->base.stats), ret, fail);
   NCCLCHECKGOTO(ncclSocketInit(&comm->base.sock, &handle->connectAddr, handle->magic, ncclSocketTypeNetIb, NULL, 1), ret, fail);
   stage->comm = comm;
@@ -1167,25 +2246,40 @@ ib_connect_check:
   struct ncclIbMergedDev* mergedDev;
   mergedDev = ncclIbMergedDevs + dev;
   comm->base.ndevs = mergedDev->ndevs;
-  comm->base.nqps = ncclParamIbQpsPerConn() * comm->base.ndevs; // We must have at least 1 qp per-device
+  // Plan the rail mapping with the listener's layout, or a symmetric one if it did not publish it
+  struct ncclIbRailInfo rails;
+  ncclIbRailOrder(dev, &rails);
+  memcpy(comm->base.devOrder, rails.devOrder, sizeof(rails.devOrder));
+  struct ncclIbRailInfo* remRails;
+  remRails = handle->rails.ndevs ? &handle->rails : &rails;
+  comm->base.nRemDevs = remRails->ndevs;
+  memcpy(comm->base.remDevOrder, remRails->devOrder, sizeof(remRails->devOrder));
+  comm->base.nqpsTarget = ncclIbRailQps(&comm->base, ncclIbQpsPerConn(mergedDev)); // We must have at least 1 qp per-device
+  // Lazily, start with one QP per device of the side with the most devices
+  comm->base.nqps = siclParamUnetIbLazyQps() ? std::max(comm->base.ndevs, comm->base.nRemDevs) : comm->base.nqpsTarget;
+  comm->base.lazy.state = (comm->base.nqps < comm->base.nqpsTarget) ? ncclIbLazyStateStart : ncclIbLazyStateDone;
   comm->base.isSend = true;
 
   // Init PD, Ctx for each IB device
   comm->ar = 1; // Set to 1 for logic
   for (int i = 0; i < mergedDev->ndevs; i++) {
     int ibDevN = mergedDev->devs[i];
-    NCCLCHECKGOTO(ncclIbInitCommDevBase(ibDevN, &comm->devs[i].base, &comm->base.stats), ret, fail);
-    comm->ar = comm->ar && ncclIbDevs[dev].ar; // ADAPTIVE_ROUTING - if all merged devs have it enabled
+    NCCLCHECKGOTO(ncclIbInitCommDevBase(ibDevN, &comm->devs[i].base, comm->base.maxRequests, ncclIbRailDevQps(&comm->base, i), &comm->base.stats), ret, fail);
+    comm->ar = comm->ar && ncclIbDevs[ibDevN].ar; // ADAPTIVE_ROUTING - if all merged devs have it enabled
   }
+  ncclIbPaceInit(comm);
 
   struct ncclIbConnectionMetadata meta;
   meta.rank = rank_;
   meta.ndevs = comm->base.ndevs;
+  meta.nqps = comm->base.nqps;
+  meta.nqpsTarget = comm->base.nqpsTarget;
+  memcpy(meta.devOrder, comm->base.devOrder, sizeof(meta.devOrder));
 
-  // Alternate QPs between devices
-  int devIndex;
-  devIndex = 0;
+  // Stripe QPs over the rails
+  int devIndex, remDevIndex;
   for (int q = 0; q < comm->base.nqps; q++) {
+    ncclIbRailMap(&comm->base, q, &devIndex, &remDevIndex);
     struct ncclIbSendCommDev* commDev = comm->devs + devIndex;
     struct ncclIbDev* ibDev = ncclIbDevs + commDev->base.ibDevN;
     NCCLCHECKGOTO(ncclIbCreateQp(ibDev->portNum, &commDev->base, IBV_ACCESS_REMOTE_WRITE, &comm->base.stats, comm->base.qps + q), ret, fail);
@@ -1199,7 +2293,19 @@ ib_connect_check:
     } else {
       meta.qpInfo[q].ece_supported = 0;
     }
-    devIndex = (devIndex + 1) % comm->base.ndevs;
+  }
+
+  // Latency lane on the first rail, offered to the receiver
+  comm->base.latLane = siclParamUnetIbLatLane() ? 1 : 0;
+  meta.latLane = comm->base.latLane;
+  if (comm->base.latLane) {
+    devIndex = comm->base.devOrder[0];
+    struct ncclIbSendCommDev* commDev = comm->devs + devIndex;
+    NCCLCHECKGOTO(ncclIbCreateQp(ncclIbDevs[commDev->base.ibDevN].portNum, &commDev->base, IBV_ACCESS_REMOTE_WRITE, &comm->base.stats, &comm->base.latQp), ret, fail);
+    comm->base.latQp.devIndex = devIndex;
+    meta.latQp.qpn = comm->base.latQp.qp->qp_num;
+    meta.latQp.devIndex = devIndex;
+    meta.latQp.ece_supported = 0;
   }
 
   for (int i = 0; i < comm->base.ndevs; i++) {
@@ -1213,7 +2319,7 @@ ib_connect_check:
     devInfo->lid           = ibDev->portAttr.lid;
 
     // Prepare my fifo
-    NCCLCHECKGOTO(wrap_ibv_reg_mr(&commDev->fifoMr, commDev->base.pd, comm->fifo, sizeof(struct ncclIbSendFifo)*MAX_REQUESTS*NCCL_NET_IB_MAX_RECVS, IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ), ret, fail);
+    NCCLCHECKGOTO(wrap_ibv_reg_mr(&commDev->fifoMr, commDev->base.pd, comm->fifo, NCCL_IB_FIFO_BYTES(&comm->base), IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ), ret, fail);
     devInfo->fifoRkey = commDev->fifoMr->rkey;
 
     // RoCE support
@@ -1232,7 +2338,7 @@ ib_connect_check:
         // Print just the QPs for this dev
         if (comm->base.qps[q].devIndex == i)
           INFO(NCCL_NET, "UNET/IBV : %s %d IbDev %d Port %d qpn %d mtu %d LID %d fifoRkey=0x%x fifoLkey=0x%x",
-            comm->base.ndevs > 2 ? "NCCL MergedDev" : "NCCL Dev",
+            comm->base.ndevs > 1 ? "NCCL MergedDev" : "NCCL Dev",
             dev, commDev->base.ibDevN, ibDev->portNum, meta.qpInfo[q].qpn, devInfo->mtu, devInfo->lid, devInfo->fifoRkey, commDev->fifoMr->lkey);
       }
     } else { // RoCE
@@ -1240,7 +2346,7 @@ ib_connect_check:
         // Print just the QPs for this dev
         if (comm->base.qps[q].devIndex == i)
           INFO(NCCL_NET, "UNET/IBV : %s %d IbDev %d Port %d qpn %d mtu %d query_ece={supported=%d, vendor_id=0x%x, options=0x%x, comp_mask=0x%x} GID %ld (%lX/%lX) fifoRkey=0x%x fifoLkey=0x%x",
-            comm->base.ndevs > 2 ? "NCCL MergedDev" : "NCCL Dev", dev,
+            comm->base.ndevs > 1 ? "NCCL MergedDev" : "NCCL Dev", dev,
             commDev->base.ibDevN, ibDev->portNum, meta.qpInfo[q].qpn, devInfo->mtu, meta.qpInfo[q].ece_supported, meta.qpInfo[q].ece.vendor_id, meta.qpInfo[q].ece.options, meta.qpInfo[q].ece.comp_mask, (int64_t)commDev->base.gidInfo.localGidIndex,
             devInfo->spn, devInfo->iid, devInfo->fifoRkey, commDev->fifoMr->lkey);
       }
@@ -1272,11 +2378,17 @@ ib_connect:
   memcpy(&remMeta, stage->buffer, sizeof(struct ncclIbConnectionMetadata));
 
   comm->peer_rank = remMeta.rank;
-  comm->base.nRemDevs = remMeta.ndevs;
+  comm->bwPeer = bw_stat_ ? ucommd::getUnetBwPeer(comm->peer_rank) : -1;
+  comm->base.latStat = ib_stat_ ? ucommd::getUnetLatStat(comm->peer_rank, dev) : NULL;
+  if (remMeta.ndevs != comm->base.nRemDevs || memcmp(remMeta.devOrder, comm->base.remDevOrder, remMeta.ndevs) != 0) {
+    WARN("UNET/IBV : Remote mergedDev %s has %d devices, planned rail mapping for %d", remMeta.devName, remMeta.ndevs, comm->base.nRemDevs);
+    ret = ncclInternalError;
+    goto fail;
+  }
   if (comm->base.nRemDevs != comm->base.ndevs) {
     mergedDev = ncclIbMergedDevs + dev;
-    WARN("UNET/IBV : Local mergedDev=%s has a different number of devices=%d as remoteDev=%s nRemDevs=%d",
-      mergedDev->devName, comm->base.ndevs, remMeta.devName, comm->base.nRemDevs);
+    INFO(NCCL_NET, "UNET/IBV : Local mergedDev=%s has %d devices, remoteDev=%s has %d, striping %d QPs over the rails",
+      mergedDev->devName, comm->base.ndevs, remMeta.devName, comm->base.nRemDevs, comm->base.nqpsTarget);
   }
 
   int link_layer;
@@ -1301,10 +2413,21 @@ ib_connect:
   }
 
   for (int i=0; i < comm->base.ndevs; i++) {
-    NCCLCHECKGOTO(wrap_ibv_reg_mr(comm->remSizesFifo.mrs+i, comm->devs[i].base.pd, &comm->remSizesFifo.elems, sizeof(int)*MAX_REQUESTS*NCCL_NET_IB_MAX_RECVS, IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_READ), ret, fail);
+    NCCLCHECKGOTO(wrap_ibv_reg_mr(comm->remSizesFifo.mrs+i, comm->devs[i].base.pd, comm->remSizesFifo.elems, NCCL_IB_SIZES_FIFO_BYTES(&comm->base), IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_READ), ret, fail);
   }
   comm->base.nRemDevs = remMeta.ndevs;
 
+  if (remMeta.nqpsTarget < comm->base.nqpsTarget) {
+    // The receiver capped the QP count with its own budget, drop the QPs it did not connect
+    for (int q = remMeta.nqps; q < comm->base.nqps; q++) {
+      NCCLCHECKGOTO(ncclIbDestroyQp(&comm->devs[comm->base.qps[q].devIndex].base, comm->base.qps + q), ret, fail);
+    }
+    INFO(NCCL_NET, "UNET/IBV : peer rank %d capped QPs per connection to %d (was %d)", comm->peer_rank, remMeta.nqpsTarget, comm->base.nqpsTarget);
+    comm->base.nqps = remMeta.nqps;
+    comm->base.nqpsTarget = remMeta.nqpsTarget;
+    comm->base.lazy.state = (comm->base.nqps < comm->base.nqpsTarget) ? ncclIbLazyStateStart : ncclIbLazyStateDone;
+  }
+
   for (int q = 0; q < comm->base.nqps; q++) {
     struct ncclIbQpInfo* remQpInfo   = remMeta.qpInfo + q;
     struct ncclIbDevInfo* remDevInfo = remMeta.devs + remQpInfo->devIndex;
@@ -1320,6 +2443,28 @@ ib_connect:
 
     NCCLCHECKGOTO(ncclIbRtrQp(qp, commDev->base.gidInfo.localGidIndex, remQpInfo->qpn, remDevInfo, false), ret, fail);
     NCCLCHECKGOTO(ncclIbRtsQp(qp), ret, fail);
+    NCCLCHECKGOTO(ncclIbPaceQp(comm, comm->base.qps + q), ret, fail);
+    ncclIbQpStatInit(comm, comm->base.qps + q);
+  }
+
+  if (comm->base.latLane && !remMeta.latLane) {
+    // The receiver does not use the latency lane
+    NCCLCHECKGOTO(ncclIbDestroyQp(&comm->devs[comm->base.latQp.devIndex].base, &comm->base.latQp), ret, fail);
+    comm->base.latLane = 0;
+  } else if (comm->base.latLane) {
+    struct ncclIbQp* latQp = &comm->base.latQp;
+    if (remMeta.latQp.devIndex < 0 || remMeta.latQp.devIndex >= remMeta.ndevs) {
+      WARN("UNET/IBV : peer rank %d latency lane QP on remote device %d of %d", comm->peer_rank, remMeta.latQp.devIndex, remMeta.ndevs);
+      ret = ncclInternalError;
+      goto fail;
+    }
+    latQp->remDevIdx = remMeta.latQp.devIndex;
+    NCCLCHECKGOTO(ncclIbRtrLatQp(latQp->qp, comm->devs[latQp->devIndex].base.gidInfo.localGidIndex, remMeta.latQp.qpn, remMeta.devs + latQp->remDevIdx), ret, fail);
+    NCCLCHECKGOTO(ncclIbRtsQp(latQp->qp), ret, fail);
+    NCCLCHECKGOTO(ncclIbPaceQp(comm, latQp), ret, fail);
+    ncclIbQpStatInit(comm, latQp);
+    INFO(NCCL_NET, "UNET/IBV : peer rank %d latency lane qpn %d dev %d -> remote dev %d, threshold %ld",
+      comm->peer_rank, latQp->qp->qp_num, latQp->devIndex, latQp->remDevIdx, siclParamUnetIbLatThreshold());
   }
 
   if (link_layer == IBV_LINK_LAYER_ETHERNET ) { // RoCE
@@ -1346,12 +2491,38 @@ exit:
   stage->state = ncclIbCommStateStart;
   return ret;
 fail:
+  if (comm) ncclIbSendCommFreeCtrl(comm);
   free(comm);
   goto exit;
 }
 
 NCCL_PARAM(IbGdrFlushDisable, "GDR_FLUSH_DISABLE", 0);
 
+// Receiver-driven pacing: limit the bytes granted through CTS and not received
+// yet by all the recv comms of a device to SICL_UNET_IB_CTS_GRANT_BYTES, or to
+// SICL_UNET_IB_CTS_GRANT_US worth of the port bandwidth when < 0, so that many
+// senders do not write into one NIC at once. Every comm may always have one
+// grant, beyond that it gets a fair share of the budget among the active comms.
+SICL_PARAM(UnetIbCtsPacing, "UNET_IB_CTS_PACING", 0);
+SICL_PARAM(UnetIbCtsGrantBytes, "UNET_IB_CTS_GRANT_BYTES", -1);
+SICL_PARAM(UnetIbCtsGrantUs, "UNET_IB_CTS_GRANT_US", 100);
+
+static ncclResult_t ncclIbCtsQueueAlloc(struct ncclIbRecvComm* comm) {
+  const int depth = comm->base.maxRequests, width = comm->base.maxRecvs;
+  NCCLCHECK(ncclCalloc(&comm->ctsQueue, depth));
+  NCCLCHECK(ncclCalloc((char**)&comm->ctsArgs, (size_t)depth*width*(2*sizeof(void*)+2*sizeof(int))));
+  void** ptrs = (void**)comm->ctsArgs;
+  int* ints = (int*)(ptrs + 2*depth*width);
+  for (int i = 0; i < depth; i++) {
+    struct ncclIbCtsDeferred* e = comm->ctsQueue + i;
+    e->data = ptrs + (2*i)*width;
+    e->mhandles = ptrs + (2*i+1)*width;
+    e->sizes = ints + (2*i)*width;
+    e->tags = ints + (2*i+1)*width;
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclIbAccept(void* listenComm, void** recvComm, ncclNetDeviceHandle_t** /*recvDevComm*/) {
   ncclResult_t ret = ncclSuccess;
   struct ncclIbListenComm* lComm = (struct ncclIbListenComm*)listenComm;
@@ -1369,7 +2540,12 @@ ncclResult_t ncclIbAccept(void* listenComm, void** recvComm, ncclNetDeviceHandle
     return ncclInternalError;
   }
 
-  NCCLCHECK(ncclIbMalloc((void**)&rComm, sizeof(struct ncclIbRecvComm)));
+  NCCLCHECK(ncclIbAllocComm((void**)&rComm, sizeof(struct ncclIbRecvComm), lComm->dev, "recvComm"));
+  rComm->base.maxRequests = lComm->maxRequests;
+  rComm->base.maxRecvs = lComm->maxRecvs;
+  NCCLCHECKGOTO(ncclCalloc(&rComm->base.reqs, rComm->base.maxRequests), ret, fail);
+  NCCLCHECKGOTO(ncclIbCtrlAlloc((void**)&rComm->remFifo.elems, NCCL_IB_FIFO_BYTES(&rComm->base), ncclIbMergedDevNumaNode(lComm->dev)), ret, fail);
+  NCCLCHECKGOTO(ncclIbCtrlAlloc((void**)&rComm->sizesFifo, NCCL_IB_SIZES_FIFO_BYTES(&rComm->base), ncclIbMergedDevNumaNode(lComm->dev)), ret, fail);
   NCCLCHECKGOTO(ncclIbStatsInit(&rComm->base.stats), ret, fail);
   stage->comm = rComm;
   stage->state = ncclIbCommStateAccept;
@@ -1403,14 +2579,28 @@ ib_recv:
 
   mergedDev = ncclIbMergedDevs + lComm->dev;
   rComm->peer_rank = remMeta.rank;
+  rComm->bwPeer = bw_stat_ ? ucommd::getUnetBwPeer(rComm->peer_rank) : -1;
+  rComm->base.latStat = ib_stat_ ? ucommd::getUnetLatStat(rComm->peer_rank, lComm->dev) : NULL;
   rComm->base.ndevs = mergedDev->ndevs;
-  rComm->base.nqps  = ncclParamIbQpsPerConn() * rComm->base.ndevs; // We must have at least 1 qp per-device
+  rComm->base.nRemDevs = remMeta.ndevs;
+  memcpy(rComm->base.devOrder, lComm->rails.devOrder, sizeof(lComm->rails.devOrder));
+  memcpy(rComm->base.remDevOrder, remMeta.devOrder, sizeof(remMeta.devOrder));
+  // Follow the sender, which decides how many QPs are connected now and later,
+  // unless our own NIC has room for fewer (kept a multiple of the rail period)
+  rComm->base.nqpsTarget = remMeta.nqpsTarget;
+  int nqpsCap, railPeriod;
+  nqpsCap = ncclIbRailQps(&rComm->base, ncclIbQpsPerConn(mergedDev));
+  railPeriod = ncclIbRailPeriod(&rComm->base);
+  if (nqpsCap < rComm->base.nqpsTarget) {
+    rComm->base.nqpsTarget = std::max(railPeriod, nqpsCap - nqpsCap % railPeriod);
+  }
+  rComm->base.nqps  = std::min(remMeta.nqps, rComm->base.nqpsTarget);
+  rComm->base.lazy.state = (rComm->base.nqps < rComm->base.nqpsTarget) ? ncclIbLazyStateStart : ncclIbLazyStateDone;
   rComm->base.isSend = false;
 
-  rComm->base.nRemDevs = remMeta.ndevs;
   if (rComm->base.nRemDevs != rComm->base.ndevs) {
-    WARN("UNET/IBV : Local mergedDev %s has a different number of devices=%d as remote %s %d",
-      mergedDev->devName, rComm->base.ndevs, remMeta.devName, rComm->base.nRemDevs);
+    INFO(NCCL_NET, "UNET/IBV : Local mergedDev %s has %d devices, remote %s has %d, striping %d QPs over the rails",
+      mergedDev->devName, rComm->base.ndevs, remMeta.devName, rComm->base.nRemDevs, rComm->base.nqpsTarget);
   }
 
   // Metadata to send back to requestor (sender)
@@ -1419,7 +2609,7 @@ ib_recv:
   for (int i = 0; i < rComm->base.ndevs; i++) {
     rCommDev = rComm->devs + i;
     ibDevN = mergedDev->devs[i];
-    NCCLCHECKGOTO(ncclIbInitCommDevBase(ibDevN, &rCommDev->base, &rComm->base.stats), ret, fail);
+    NCCLCHECKGOTO(ncclIbInitCommDevBase(ibDevN, &rCommDev->base, rComm->base.maxRequests, ncclIbRailDevQps(&rComm->base, i), &rComm->base.stats), ret, fail);
     ibDev = ncclIbDevs + ibDevN;
     NCCLCHECKGOTO(ncclIbGetGidIndex(ibDev->context, ibDev->portNum, ibDev->portAttr.gid_tbl_len, &rCommDev->base.gidInfo.localGidIndex), ret, fail);
     NCCLCHECKGOTO(wrap_ibv_query_gid(ibDev->context, ibDev->portNum, rCommDev->base.gidInfo.localGidIndex, &rCommDev->base.gidInfo.localGid), ret, fail);
@@ -1432,13 +2622,17 @@ ib_recv:
     rComm->base.remDevs[i].remoteGid.global.subnet_prefix = rComm->base.remDevs[i].spn;
   }
 
-  // Stripe QP creation across merged devs
+  // Stripe QP creation over the rails, as the sender planned it
   // Make sure to get correct remote peer dev and QP info
   int remDevIndex;
   int devIndex;
-  devIndex = 0;
   for (int q = 0; q < rComm->base.nqps; q++) {
-    remDevIndex = remMeta.qpInfo[q].devIndex;
+    ncclIbRailMap(&rComm->base, q, &devIndex, &remDevIndex);
+    if (remMeta.qpInfo[q].devIndex != remDevIndex) {
+      WARN("UNET/IBV : peer rank %d QP %d is on remote device %d, expected %d", rComm->peer_rank, q, remMeta.qpInfo[q].devIndex, remDevIndex);
+      ret = ncclInternalError;
+      goto fail;
+    }
     remDevInfo = remMeta.devs + remDevIndex;
     qp = rComm->base.qps+q;
     rCommDev = rComm->devs + devIndex;
@@ -1449,7 +2643,6 @@ ib_recv:
     ibDev = ncclIbDevs + ibDevN;
     NCCLCHECKGOTO(ncclIbCreateQp(ibDev->portNum, &rCommDev->base, IBV_ACCESS_REMOTE_WRITE, &rComm->base.stats, qp), ret, fail);
     qp->devIndex = devIndex;
-    devIndex = (devIndex + 1) % rComm->base.ndevs;
 
     // Set the ece (enhanced connection establishment) on this QP before RTR
     if (remMeta.qpInfo[q].ece_supported) {
@@ -1469,6 +2662,31 @@ ib_recv:
     NCCLCHECKGOTO(ncclIbRtsQp(qp->qp), ret, fail);
   }
 
+  rComm->ctsDevN = rComm->devs[0].base.ibDevN;
+  rComm->ctsMergedDev = lComm->dev;
+  if (siclParamUnetIbCtsPacing()) NCCLCHECKGOTO(ncclIbCtsQueueAlloc(rComm), ret, fail);
+
+  // Latency lane, when the sender offers it and we use it too
+  rComm->base.latLane = (remMeta.latLane && siclParamUnetIbLatLane()) ? 1 : 0;
+  meta.latLane = rComm->base.latLane;
+  if (rComm->base.latLane) {
+    if (remMeta.latQp.devIndex < 0 || remMeta.latQp.devIndex >= remMeta.ndevs) {
+      WARN("UNET/IBV : peer rank %d latency lane QP on remote device %d of %d", rComm->peer_rank, remMeta.latQp.devIndex, remMeta.ndevs);
+      ret = ncclInternalError;
+      goto fail;
+    }
+    qp = &rComm->base.latQp;
+    qp->devIndex = rComm->base.devOrder[0];
+    qp->remDevIdx = remMeta.latQp.devIndex;
+    rCommDev = rComm->devs + qp->devIndex;
+    NCCLCHECKGOTO(ncclIbCreateQp(ncclIbDevs[rCommDev->base.ibDevN].portNum, &rCommDev->base, IBV_ACCESS_REMOTE_WRITE, &rComm->base.stats, qp), ret, fail);
+    NCCLCHECKGOTO(ncclIbRtrLatQp(qp->qp, rCommDev->base.gidInfo.localGidIndex, remMeta.latQp.qpn, remMeta.devs + qp->remDevIdx), ret, fail);
+    NCCLCHECKGOTO(ncclIbRtsQp(qp->qp), ret, fail);
+    meta.latQp.qpn = qp->qp->qp_num;
+    meta.latQp.devIndex = qp->devIndex;
+    meta.latQp.ece_supported = 0;
+  }
+
   rComm->flushEnabled = ((ncclIbGdrSupport() == ncclSuccess || ncclIbDmaBufSupport(lComm->dev) == ncclSuccess)
                             && (ncclParamIbGdrFlushDisable() == 0)) ? 1 : 0;
 
@@ -1480,27 +2698,14 @@ ib_recv:
     // Retain remote fifo info and prepare my RDMA ops
     rCommDev->fifoRkey = remMeta.devs[i].fifoRkey;
     rComm->remFifo.addr = remMeta.fifoAddr;
-    NCCLCHECKGOTO(wrap_ibv_reg_mr(&rCommDev->fifoMr, rCommDev->base.pd, &rComm->remFifo.elems, sizeof(struct ncclIbSendFifo)*MAX_REQUESTS*NCCL_NET_IB_MAX_RECVS, IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_READ), ret, fail);
+    NCCLCHECKGOTO(wrap_ibv_reg_mr(&rCommDev->fifoMr, rCommDev->base.pd, rComm->remFifo.elems, NCCL_IB_FIFO_BYTES(&rComm->base), IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_READ), ret, fail);
     rCommDev->fifoSge.lkey = rCommDev->fifoMr->lkey;
     if (ncclParamIbUseInline()) rComm->remFifo.flags = IBV_SEND_INLINE;
 
-    // Allocate Flush dummy buffer for GPU Direct RDMA
+    // Share the device flush QP for GPU Direct RDMA
     if (rComm->flushEnabled) {
-      NCCLCHECKGOTO(wrap_ibv_reg_mr(&rCommDev->gpuFlush.hostMr, rCommDev->base.pd, &rComm->gpuFlushHostMem, sizeof(int), IBV_ACCESS_LOCAL_WRITE), ret, fail);
-      rCommDev->gpuFlush.sge.addr = (uint64_t)&rComm->gpuFlushHostMem;
-      rCommDev->gpuFlush.sge.length = 1;
-      rCommDev->gpuFlush.sge.lkey = rCommDev->gpuFlush.hostMr->lkey;
-      NCCLCHECKGOTO(ncclIbCreateQp(ibDev->portNum, &rCommDev->base, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ, &rComm->base.stats, &rCommDev->gpuFlush.qp), ret, fail);
-      struct ncclIbDevInfo devInfo;
-      devInfo.lid         = ibDev->portAttr.lid;
-      devInfo.link_layer  = ibDev->portAttr.link_layer;
-      devInfo.ib_port     = ibDev->portNum;
-      devInfo.spn         = rCommDev->base.gidInfo.localGid.global.subnet_prefix;
-      devInfo.iid         = rCommDev->base.gidInfo.localGid.global.interface_id;
-      devInfo.is_global   = (ncclParamIbIsGlobal() || (ibDev->portAttr.flags & IBV_QPF_GRH_REQUIRED));
-      devInfo.mtu         = ibDev->portAttr.active_mtu;
-      NCCLCHECKGOTO(ncclIbRtrQp(rCommDev->gpuFlush.qp.qp, rCommDev->base.gidInfo.localGidIndex, rCommDev->gpuFlush.qp.qp->qp_num, &devInfo, false), ret, fail);
-      NCCLCHECKGOTO(ncclIbRtsQp(rCommDev->gpuFlush.qp.qp), ret, fail);
+      NCCLCHECKGOTO(ncclIbFlushRetain(ibDevN, &rCommDev->base.gidInfo), ret, fail);
+      rComm->flushRetained++;
     }
 
     // Fill Handle
@@ -1511,12 +2716,12 @@ ib_recv:
     meta.devs[i].iid        = rCommDev->base.gidInfo.localGid.global.interface_id;
     meta.devs[i].is_global  = (ncclParamIbIsGlobal() || (ibDev->portAttr.flags & IBV_QPF_GRH_REQUIRED));
 
-    // Adjust the MTU
-    remMeta.devs[i].mtu    = (enum ibv_mtu) std::min(remMeta.devs[i].mtu, ibDev->portAttr.active_mtu);
-    meta.devs[i].mtu      = remMeta.devs[i].mtu;
+    // Adjust the MTU, to what every remote device this one may be paired with supports
+    meta.devs[i].mtu = ibDev->portAttr.active_mtu;
+    for (int r = 0; r < remMeta.ndevs; r++) meta.devs[i].mtu = (enum ibv_mtu) std::min(meta.devs[i].mtu, remMeta.devs[r].mtu);
 
     // Prepare sizes fifo
-    NCCLCHECKGOTO(wrap_ibv_reg_mr(&rComm->devs[i].sizesFifoMr, rComm->devs[i].base.pd, rComm->sizesFifo, sizeof(int)*MAX_REQUESTS*NCCL_NET_IB_MAX_RECVS, IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ), ret, fail);
+    NCCLCHECKGOTO(wrap_ibv_reg_mr(&rComm->devs[i].sizesFifoMr, rComm->devs[i].base.pd, rComm->sizesFifo, NCCL_IB_SIZES_FIFO_BYTES(&rComm->base), IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ), ret, fail);
     meta.devs[i].fifoRkey = rComm->devs[i].sizesFifoMr->rkey;
   }
   meta.fifoAddr = (uint64_t)rComm->sizesFifo;
@@ -1527,6 +2732,9 @@ ib_recv:
   }
 
   meta.ndevs = rComm->base.ndevs;
+  memcpy(meta.devOrder, rComm->base.devOrder, sizeof(meta.devOrder));
+  meta.nqps = rComm->base.nqps;
+  meta.nqpsTarget = rComm->base.nqpsTarget;
   strncpy(meta.devName, mergedDev->devName, MAX_MERGED_DEV_NAME);
 
   stage->state = ncclIbCommStateSend;
@@ -1559,19 +2767,26 @@ exit:
   stage->buffer = NULL;
   return ret;
 fail:
+  if (rComm) {
+    for (int i = 0; i < rComm->flushRetained; i++) (void)ncclIbFlushRelease(rComm->devs[i].base.ibDevN);
+    ncclIbRecvCommFreeCtrl(rComm);
+  }
   free(rComm);
   goto exit;
 }
 
 ncclResult_t ncclIbGetRequest(struct ncclIbNetCommBase* base, struct ncclIbRequest** req) {
-  for (int i=0; i<MAX_REQUESTS; i++) {
+  for (int i=0; i<base->maxRequests; i++) {
     struct ncclIbRequest* r = base->reqs+i;
     if (r->type == NCCL_NET_IB_REQ_UNUSED) {
       r->base = base;
       r->sock = NULL;
-      r->devBases[0] = NULL;
-      r->devBases[1] = NULL;
-      r->events[0] = r->events[1] = 0;
+      for (int i = 0; i < NCCL_IB_MAX_DEVS_PER_NIC; i++) {
+        r->devBases[i] = NULL;
+        r->events[i] = 0;
+      }
+      r->eventMask = 0;
+      r->time = ncclIbStatsDetail() ? ncclIbTicks() : 0;
       *req = r;
       return ncclSuccess;
     }
@@ -1714,15 +2929,142 @@ ncclResult_t ncclIbDeregMr(void* comm, void* mhandle) {
   return ncclSuccess;
 }
 
+// Lazy QPs, receiver side: create the remaining data QPs, send their info to
+// the sender, then connect them with the sender's reply. Once done, the new
+// QP count is advertised to the sender through the CTS fifo entries.
+static ncclResult_t ncclIbRecvLazyQpsProgress(struct ncclIbRecvComm* comm) {
+  struct ncclIbNetCommBase* base = &comm->base;
+  struct ncclIbLazyStage* stage = &base->lazy;
+  if (stage->state == ncclIbLazyStateDone) return ncclSuccess;
+  if (stage->state == ncclIbLazyStateSend) goto lazy_send;
+  if (stage->state == ncclIbLazyStateRecv) goto lazy_recv;
+
+  NCCLCHECK(ncclIbMalloc((void**)&stage->buffer, sizeof(struct ncclIbLazyQpMeta)));
+  for (int q = base->nqps; q < base->nqpsTarget; q++) {
+    struct ncclIbQp* qp = base->qps + q;
+    struct ncclIbQpInfo* qpInfo = stage->buffer->qpInfo + q;
+    int devIndex, remDevIndex;
+    ncclIbRailMap(base, q, &devIndex, &remDevIndex);
+    struct ncclIbRecvCommDev* rCommDev = comm->devs + devIndex;
+    NCCLCHECK(ncclIbCreateQp(ncclIbDevs[rCommDev->base.ibDevN].portNum, &rCommDev->base, IBV_ACCESS_REMOTE_WRITE, &base->stats, qp));
+    qp->devIndex = devIndex;
+    qpInfo->qpn = qp->qp->qp_num;
+    qpInfo->devIndex = devIndex;
+    if (ncclParamIbEceEnable()) {
+      NCCLCHECK(wrap_ibv_query_ece(qp->qp, &qpInfo->ece, &qpInfo->ece_supported));
+    } else {
+      qpInfo->ece_supported = 0;
+    }
+  }
+  stage->state = ncclIbLazyStateSend;
+  stage->offset = 0;
+
+lazy_send:
+  NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_SEND, &base->sock, stage->buffer, sizeof(struct ncclIbLazyQpMeta), &stage->offset));
+  if (stage->offset != sizeof(struct ncclIbLazyQpMeta)) return ncclSuccess;
+  stage->state = ncclIbLazyStateRecv;
+  stage->offset = 0;
+
+lazy_recv:
+  NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_RECV, &base->sock, stage->buffer, sizeof(struct ncclIbLazyQpMeta), &stage->offset));
+  if (stage->offset != sizeof(struct ncclIbLazyQpMeta)) return ncclSuccess;
+
+  for (int q = base->nqps; q < base->nqpsTarget; q++) {
+    struct ncclIbQp* qp = base->qps + q;
+    struct ncclIbQpInfo* remQpInfo = stage->buffer->qpInfo + q;
+    qp->remDevIdx = remQpInfo->devIndex;
+    if (remQpInfo->ece_supported)
+      NCCLCHECK(wrap_ibv_set_ece(qp->qp, &remQpInfo->ece, &remQpInfo->ece_supported));
+    NCCLCHECK(ncclIbRtrQp(qp->qp, comm->devs[qp->devIndex].base.gidInfo.localGidIndex, remQpInfo->qpn, base->remDevs + qp->remDevIdx, false));
+    NCCLCHECK(ncclIbRtsQp(qp->qp));
+  }
+  INFO(NCCL_NET, "UNET/IBV : peer rank %d lazy QPs connected, nqps %d -> %d", comm->peer_rank, base->nqps, base->nqpsTarget);
+  base->nqps = base->nqpsTarget;
+  free(stage->buffer);
+  stage->buffer = NULL;
+  stage->state = ncclIbLazyStateDone;
+  return ncclSuccess;
+}
+
+// Lazy QPs, sender side: wait for the receiver's QP info, connect matching QPs
+// and reply with ours. The sender switches to the full QP set when the
+// receiver says so in a CTS fifo entry.
+static ncclResult_t ncclIbSendLazyQpsProgress(struct ncclIbSendComm* comm) {
+  struct ncclIbNetCommBase* base = &comm->base;
+  struct ncclIbLazyStage* stage = &base->lazy;
+  if (stage->state == ncclIbLazyStateDone) return ncclSuccess;
+  if (stage->state == ncclIbLazyStateSend) goto lazy_send;
+
+  if (stage->buffer == NULL) NCCLCHECK(ncclIbMalloc((void**)&stage->buffer, sizeof(struct ncclIbLazyQpMeta)));
+  NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_RECV, &base->sock, stage->buffer, sizeof(struct ncclIbLazyQpMeta), &stage->offset));
+  if (stage->offset != sizeof(struct ncclIbLazyQpMeta)) return ncclSuccess;
+
+  for (int q = base->nqps; q < base->nqpsTarget; q++) {
+    struct ncclIbQp* qp = base->qps + q;
+    struct ncclIbQpInfo* qpInfo = stage->buffer->qpInfo + q;
+    struct ncclIbQpInfo remQpInfo = *qpInfo;
+    int devIndex, remDevIndex;
+    ncclIbRailMap(base, q, &devIndex, &remDevIndex);
+    struct ncclIbSendCommDev* commDev = comm->devs + devIndex;
+    NCCLCHECK(ncclIbCreateQp(ncclIbDevs[commDev->base.ibDevN].portNum, &commDev->base, IBV_ACCESS_REMOTE_WRITE, &base->stats, qp));
+    qp->devIndex = devIndex;
+    qp->remDevIdx = remQpInfo.devIndex;
+
+    // Reply in place with our own QP info, carrying the reduced ece back
+    memset(qpInfo, 0, sizeof(struct ncclIbQpInfo));
+    qpInfo->qpn = qp->qp->qp_num;
+    qpInfo->devIndex = devIndex;
+    if (remQpInfo.ece_supported) {
+      NCCLCHECK(wrap_ibv_set_ece(qp->qp, &remQpInfo.ece, &qpInfo->ece_supported));
+      if (qpInfo->ece_supported)
+        NCCLCHECK(wrap_ibv_query_ece(qp->qp, &qpInfo->ece, &qpInfo->ece_supported));
+    }
+    NCCLCHECK(ncclIbRtrQp(qp->qp, commDev->base.gidInfo.localGidIndex, remQpInfo.qpn, base->remDevs + qp->remDevIdx, false));
+    NCCLCHECK(ncclIbRtsQp(qp->qp));
+    NCCLCHECK(ncclIbPaceQp(comm, qp));
+    ncclIbQpStatInit(comm, qp);
+  }
+  stage->state = ncclIbLazyStateSend;
+  stage->offset = 0;
+
+lazy_send:
+  NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_SEND, &base->sock, stage->buffer, sizeof(struct ncclIbLazyQpMeta), &stage->offset));
+  if (stage->offset != sizeof(struct ncclIbLazyQpMeta)) return ncclSuccess;
+  free(stage->buffer);
+  stage->buffer = NULL;
+  stage->state = ncclIbLazyStateDone;
+  return ncclSuccess;
+}
+
 NCCL_PARAM(IbSplitDataOnQps, "IB_SPLIT_DATA_ON_QPS", 0);
 
+// QPs a message is striped over: all of them, or one per device of the side
+// with the most devices, so that every rail of both sides takes part
+static int ncclIbMsgQps(struct ncclIbNetCommBase* base) {
+  return ncclParamIbSplitDataOnQps() ? base->nqps : std::max(base->ndevs, base->nRemDevs);
+}
+
 ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
-  struct ncclIbRequest** reqs = comm->fifoReqs[slot];
-  volatile struct ncclIbSendFifo* slots = comm->fifo[slot];
+  struct ncclIbRequest** reqs = comm->fifoReqs + slot*comm->base.maxRecvs;
+  volatile struct ncclIbSendFifo* slots = comm->fifo + slot*comm->base.maxRecvs;
   int nreqs = slots[0].nreqs;
-  if (nreqs > NCCL_NET_IB_MAX_RECVS) return ncclInternalError;
-
-  uint64_t wr_id = 0ULL;
+  if (nreqs > comm->base.maxRecvs) return ncclInternalError;
+  int lat = (slots[0].lane == NCCL_IB_LANE_LAT);
+
+  // Take a free completion tag for the requests of this slot. At most one tag
+  // per outstanding request is busy, so there always is one.
+  int tagIndex = comm->cplTagNext;
+  for (int t = 0; comm->cplTags[tagIndex].refs; t++) {
+    if (t == comm->base.maxRequests) {
+      WARN("UNET/IBV : peer rank %d out of completion tags", comm->peer_rank);
+      return ncclInternalError;
+    }
+    tagIndex = (tagIndex+1) % comm->base.maxRequests;
+  }
+  comm->cplTagNext = (tagIndex+1) % comm->base.maxRequests;
+  struct ncclIbCplTag* tag = comm->cplTags + tagIndex;
+  tag->nreqs = nreqs;
+  uint64_t wr_id = tagIndex;
   for (int r=0; r<nreqs; r++) {
     struct ibv_send_wr* wr = comm->wrs+r;
     memset(wr, 0, sizeof(struct ibv_send_wr));
@@ -1733,7 +3075,7 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
     wr->send_flags = 0;
     wr->wr.rdma.remote_addr = slots[r].addr;
     wr->next = wr + 1;
-    wr_id += (reqs[r] - comm->base.reqs) << (r*8);
+    tag->reqs[r] = reqs[r];
   }
 
   // Write size as immediate data. In the case of multi-send, only write
@@ -1742,7 +3084,7 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
   if (nreqs == 1) {
     immData = reqs[0]->send.size;
   } else {
-    int* sizes = comm->remSizesFifo.elems[slot];
+    int* sizes = comm->remSizesFifo.elems + slot*comm->base.maxRecvs;
     for (int r=0; r<nreqs; r++) sizes[r] = reqs[r]->send.size;
     comm->remSizesFifo.sge.addr = (uint64_t)sizes;
     comm->remSizesFifo.sge.length = nreqs*sizeof(int);
@@ -1757,7 +3099,7 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
     memset(lastWr, 0, sizeof(struct ibv_send_wr));
     if (nreqs > 1) {
       // Write remote sizes Fifo
-      lastWr->wr.rdma.remote_addr = comm->remSizesFifo.addr + slot*NCCL_NET_IB_MAX_RECVS*sizeof(int);
+      lastWr->wr.rdma.remote_addr = comm->remSizesFifo.addr + slot*comm->base.maxRecvs*sizeof(int);
       lastWr->num_sge = 1;
       lastWr->sg_list = &comm->remSizesFifo.sge;
     }
@@ -1771,11 +3113,12 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
   // Multi-QP: make sure IB writes are multiples of 128B so that LL and LL128 protocols still work
   const int align = 128;
   size_t totalSize = 0;
-  int nqps = ncclParamIbSplitDataOnQps() ? comm->base.nqps : comm->base.ndevs;
+  int nqps = lat ? 1 : ncclIbMsgQps(&comm->base);
+  tag->refs = nqps; // one signaled WR per QP
   for (int i = 0; i < nqps; i++) {
-    int qpIndex = comm->base.qpIndex;
-    struct ncclIbQp* qp = comm->base.qps + qpIndex;
+    struct ncclIbQp* qp = lat ? &comm->base.latQp : comm->base.qps + comm->base.qpIndex;
     int devIndex = qp->devIndex;
+    size_t qpBytes = 0;
     for (int r=0; r<nreqs; r++) {
       // Track this event for completion
       //ncclIbAddEvent(reqs[r], devIndex, &comm->devs[devIndex].base);
@@ -1795,18 +3138,34 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
         comm->wrs[r].sg_list = comm->sges+r;
         comm->wrs[r].num_sge = 1;
         totalSize += length;
+        qpBytes += length;
+        comm->railBytes[devIndex] += length;
+        comm->remRailBytes[qp->remDevIdx] += length;
       }
     }
 
     if (nreqs > 1) {
       // Also make sure lastWr writes remote sizes using the right lkey
       comm->remSizesFifo.sge.lkey = comm->remSizesFifo.mrs[devIndex]->lkey;
-      lastWr->wr.rdma.rkey = comm->remSizesFifo.rkeys[devIndex];
+      lastWr->wr.rdma.rkey = comm->remSizesFifo.rkeys[qp->remDevIdx];
     }
 
     struct ibv_send_wr* bad_wr;
     NCCLCHECK(wrap_ibv_post_send(qp->qp, comm->wrs, &bad_wr));
 
+    ucommd::Stat* railStat = rail_stat_[comm->devs[devIndex].base.ibDevN];
+    if ((railStat || qp->stat) && ncclIbStatsDetail()) {
+      int nwrs = lastWr - comm->wrs + 1;
+      if (railStat) {
+        railStat->add(ucommd::UNET_RAIL_TX_BYTES, qpBytes);
+        railStat->add(ucommd::UNET_RAIL_TX_WRS, nwrs);
+      }
+      if (qp->stat) {
+        qp->stat->add(ucommd::UNET_QP_TX_BYTES, qpBytes);
+        qp->stat->add(ucommd::UNET_QP_TX_WRS, nwrs);
+      }
+    }
+
     for (int r=0; r<nreqs; r++) {
       int chunkSize = DIVUP(DIVUP(reqs[r]->send.size, nqps), align) * align;
       reqs[r]->send.offset += chunkSize;
@@ -1815,35 +3174,112 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
     }
 
     // Select the next qpIndex
-    comm->base.qpIndex = (comm->base.qpIndex+1) % comm->base.nqps;
+    if (!lat) comm->base.qpIndex = (comm->base.qpIndex+1) % comm->base.nqps;
+  }
+  if (ib_stat_) {
+    ib_stat_->add(ucommd::UNET_IB_TX_BYTES, totalSize);
+    ib_stat_->inc(lat ? ucommd::UNET_IB_LAT_MSGS : ucommd::UNET_IB_BULK_MSGS);
+    ib_stat_->add(lat ? ucommd::UNET_IB_LAT_BYTES : ucommd::UNET_IB_BULK_BYTES, totalSize);
   }
-  if (ib_stat_) ib_stat_->add(ucommd::UNET_IB_TX_BYTES, totalSize);
-//if (bw_stat_) bw_stat_->add(ucommd::UNET_BW_POST_BYTES_BY_RANK(comm->peer_rank), totalSize);
+//if (bw_stat_ && comm->bwPeer >= 0) bw_stat_->add(ucommd::UNET_BW_POST_BYTES(comm->bwPeer), totalSize);
 
   return ncclSuccess;
 }
 
+// Whether the device and QP pacers let a message of size bytes go now. The
+// message is charged to the devices and QPs ncclIbMultiSend will use for it.
+static bool ncclIbPaceAdmit(struct ncclIbSendComm* comm, int lat, int size) {
+  uint64_t now = clockNano();
+  int nqps = lat ? 1 : ncclIbMsgQps(&comm->base);
+  int64_t chunkSize = DIVUP(DIVUP(size, nqps), 128) * 128;
+  int64_t devBytes[NCCL_IB_MAX_DEVS_PER_NIC] = {0};
+  int64_t left = size;
+  for (int i = 0, qpIndex = comm->base.qpIndex; i < nqps; i++, qpIndex = (qpIndex+1)%comm->base.nqps) {
+    struct ncclIbQp* qp = lat ? &comm->base.latQp : comm->base.qps + qpIndex;
+    if (!ncclIbTokenBucketReady(comm->qpPace + (lat ? NCCL_IB_MAX_QPS : qpIndex), now)) return false;
+    devBytes[qp->devIndex] += std::max((int64_t)0, std::min(left, chunkSize));
+    left -= chunkSize;
+  }
+
+  // Devices are shared with other comms, check and charge them all at once
+  int nLocked = 0;
+  bool ready = true;
+  for (; nLocked < comm->base.ndevs && ready; nLocked++) {
+    struct ncclIbDev* ibDev = ncclIbDevs + comm->devs[nLocked].base.ibDevN;
+    if (ibDev->pace.rateMbps == 0) continue;
+    pthread_mutex_lock(&ibDev->paceLock);
+    ready = ncclIbTokenBucketReady(&ibDev->pace, now);
+  }
+  for (int i = 0; i < nLocked; i++) {
+    struct ncclIbDev* ibDev = ncclIbDevs + comm->devs[i].base.ibDevN;
+    if (ibDev->pace.rateMbps == 0) continue;
+    if (ready) ncclIbTokenBucketTake(&ibDev->pace, devBytes[i]);
+    pthread_mutex_unlock(&ibDev->paceLock);
+  }
+  if (!ready) return false;
+
+  left = size;
+  for (int i = 0, qpIndex = comm->base.qpIndex; i < nqps; i++, qpIndex = (qpIndex+1)%comm->base.nqps) {
+    ncclIbTokenBucketTake(comm->qpPace + (lat ? NCCL_IB_MAX_QPS : qpIndex), std::max((int64_t)0, std::min(left, chunkSize)));
+    left -= chunkSize;
+  }
+  return true;
+}
+
 ncclResult_t ncclIbIsend(void* sendComm, void* data, int size, int tag, void* mhandle, void** request) {
   struct ncclIbSendComm* comm = (struct ncclIbSendComm*)sendComm;
   if (comm->base.ready == 0) { WARN("UNET/IBV : ncclIbIsend() called when comm->base.ready == 0"); return ncclInternalError; }
   if (comm->base.ready == 0) { *request = NULL; return ncclSuccess; }
 
   struct ncclIbMrHandle* mhandleWrapper = (struct ncclIbMrHandle*) mhandle;
+  NCCLCHECK(ncclIbSendLazyQpsProgress(comm));
 
   // Wait for the receiver to have posted the corresponding receive
   int nreqs = 0;
   volatile struct ncclIbSendFifo* slots;
 
-  int slot = (comm->fifoHead) % MAX_REQUESTS;
-  struct ncclIbRequest** reqs = comm->fifoReqs[slot];
-  slots = comm->fifo[slot];
+  int slot = (comm->fifoHead) % comm->base.maxRequests;
+  struct ncclIbRequest** reqs = comm->fifoReqs + slot*comm->base.maxRecvs;
+  slots = comm->fifo + slot*comm->base.maxRecvs;
   uint64_t idx = comm->fifoHead+1;
-  if (slots[0].idx != idx) { *request = NULL; return ncclSuccess; }
+  if (slots[0].idx != idx) {
+    if (comm->ctsWaitTime == 0 && ncclIbStatsDetail()) comm->ctsWaitTime = clockNano();
+    *request = NULL;
+    return ncclSuccess;
+  }
+  if (comm->ctsWaitIdx != idx) {
+    // First look at this CTS, count how long we waited for it
+    if (ncclIbStatsDetail()) {
+      uint64_t late = comm->ctsWaitTime ? clockNano() - comm->ctsWaitTime : 0;
+      ib_stat_->record(ucommd::UNET_IB_CTS_LATE_NS, late);
+      if (late && bw_stat_ && comm->bwPeer >= 0) bw_stat_->add(ucommd::UNET_BW_CTS_LATE_NS(comm->bwPeer), late);
+    }
+    comm->ctsWaitTime = 0;
+    comm->ctsWaitIdx = idx;
+  }
   nreqs = slots[0].nreqs;
+  if (nreqs > comm->base.maxRecvs) {
+    WARN("UNET/IBV : peer rank %d posted %d grouped receives, the fifo holds %d", comm->peer_rank, nreqs, comm->base.maxRecvs);
+    return ncclInternalError;
+  }
   // Wait until all data has arrived
   for (int r=1; r<nreqs; r++) while(slots[r].idx != idx);
   if (ib_stat_) ib_stat_->inc(ucommd::UNET_IB_FIFO_RECV_COUNT);
   __sync_synchronize(); // order the nreqsPtr load against tag/rkey/addr loads below
+  if (slots[0].nqps != (uint32_t)comm->base.nqps) {
+    if (comm->base.lazy.state != ncclIbLazyStateDone || slots[0].nqps == 0 || slots[0].nqps > (uint32_t)comm->base.nqpsTarget) {
+      WARN("UNET/IBV : peer rank %d asked for %u QPs, nqps %d target %d lazy state %d",
+        comm->peer_rank, slots[0].nqps, comm->base.nqps, comm->base.nqpsTarget, comm->base.lazy.state);
+      return ncclInternalError;
+    }
+    comm->base.nqps = slots[0].nqps;
+    // The receiver rotates from the same index when it changes the count
+    comm->base.qpIndex %= comm->base.nqps;
+  }
+  if (slots[0].lane == NCCL_IB_LANE_LAT && !comm->base.latLane) {
+    WARN("UNET/IBV : peer rank %d posted a receive on the latency lane, which is not connected", comm->peer_rank);
+    return ncclInternalError;
+  }
   for (int r=0; r<nreqs; r++) {
     if (reqs[r] != NULL || slots[r].tag != (uint32_t)tag) continue;
 
@@ -1858,6 +3294,13 @@ ncclResult_t ncclIbIsend(void* sendComm, void* data, int size, int tag, void* mh
       return ncclInternalError;
     }
 
+    // Come back later if the pacers are out of tokens
+    if (comm->pace && !ncclIbPaceAdmit(comm, slots[0].lane == NCCL_IB_LANE_LAT, size)) {
+      if (ib_stat_) ib_stat_->inc(ucommd::UNET_IB_PACE_THROTTLED);
+      *request = NULL;
+      return ncclSuccess;
+    }
+
     struct ncclIbRequest* req;
     NCCLCHECK(ncclIbGetRequest(&comm->base, &req));
     req->type = NCCL_NET_IB_REQ_SEND;
@@ -1865,13 +3308,18 @@ ncclResult_t ncclIbIsend(void* sendComm, void* data, int size, int tag, void* mh
     req->base = &comm->base;
     req->nreqs = nreqs;
     req->send.size = size;
+    if (ncclIbStatsDetail()) ib_stat_->record(ucommd::UNET_IB_SEND_SIZE, size);
     req->send.data = data;
     req->send.offset = 0;
     req->peer_rank = comm->peer_rank;
 
     // Populate events
-    int nEvents = ncclParamIbSplitDataOnQps() ? comm->base.nqps : comm->base.ndevs;
+    int nEvents = ncclIbMsgQps(&comm->base);
     int qpIndex = comm->base.qpIndex;
+    if (slots[0].lane == NCCL_IB_LANE_LAT) {
+      ncclIbAddEvent(req, comm->base.latQp.devIndex, &comm->devs[comm->base.latQp.devIndex].base);
+      nEvents = 0;
+    }
     // Count down
     while (nEvents > 0) {
       struct ncclIbQp* qp = comm->base.qps + qpIndex;
@@ -1900,7 +3348,7 @@ ncclResult_t ncclIbIsend(void* sendComm, void* data, int size, int tag, void* mh
 
     // Clear slots[0]->nreqs, as well as other fields to help debugging and sanity checks
     memset((void*)slots, 0, sizeof(struct ncclIbSendFifo));
-    memset(reqs, 0, NCCL_NET_IB_MAX_RECVS*sizeof(struct ncclIbRequest*));
+    memset(reqs, 0, comm->base.maxRecvs*sizeof(struct ncclIbRequest*));
     comm->fifoHead++;
     return ncclSuccess;
   }
@@ -1909,19 +3357,26 @@ ncclResult_t ncclIbIsend(void* sendComm, void* data, int size, int tag, void* mh
   return ncclSuccess;
 }
 
-ncclResult_t ncclIbPostFifo(struct ncclIbRecvComm* comm, int n, void** data, int* sizes, int* tags, void** mhandles, struct ncclIbRequest* req) {
+// nqps is the QP count the recv WRs of this request were posted with, which a lazy
+// QP bring-up may have raised since when the CTS was deferred
+ncclResult_t ncclIbPostFifo(struct ncclIbRecvComm* comm, int n, void** data, int* sizes, int* tags, void** mhandles, struct ncclIbRequest* req, int lane, int nqps) {
   struct ibv_send_wr wr;
   memset(&wr, 0, sizeof(wr));
 
-  int slot = comm->remFifo.fifoTail%MAX_REQUESTS;
-  req->recv.sizes = comm->sizesFifo[slot];
+  int slot = comm->remFifo.fifoTail%comm->base.maxRequests;
+  req->recv.sizes = comm->sizesFifo + slot*comm->base.maxRecvs;
   for (int i=0; i<n; i++) req->recv.sizes[i] = 0;
-  struct ncclIbSendFifo* localElem = comm->remFifo.elems[slot];
+  struct ncclIbSendFifo* localElem = comm->remFifo.elems + slot*comm->base.maxRecvs;
 
   // Select the next devIndex (local) and QP to use for posting this CTS message
   // Since QPs are initialized by striping across devIndex, we can simply assign this to the same value
-  struct ncclIbQp* ctsQp = comm->base.qps + comm->base.devIndex;
-  comm->base.devIndex = (comm->base.devIndex + 1) % comm->base.ndevs;
+  struct ncclIbQp* ctsQp;
+  if (comm->base.latLane) {
+    ctsQp = &comm->base.latQp;
+  } else {
+    ctsQp = comm->base.qps + comm->base.devIndex;
+    comm->base.devIndex = (comm->base.devIndex + 1) % comm->base.ndevs;
+  }
 
   for (int i=0; i<n; i++) {
     localElem[i].addr = (uint64_t)data[i];
@@ -1934,9 +3389,11 @@ ncclResult_t ncclIbPostFifo(struct ncclIbRecvComm* comm, int n, void** data, int
     localElem[i].nreqs = n;
     localElem[i].size = sizes[i]; // Sanity/Debugging
     localElem[i].tag = tags[i];
+    localElem[i].nqps = nqps;
+    localElem[i].lane = lane;
     localElem[i].idx = comm->remFifo.fifoTail+1;
   }
-  wr.wr.rdma.remote_addr = comm->remFifo.addr + slot*NCCL_NET_IB_MAX_RECVS*sizeof(struct ncclIbSendFifo);
+  wr.wr.rdma.remote_addr = comm->remFifo.addr + slot*comm->base.maxRecvs*sizeof(struct ncclIbSendFifo);
 
   // Lookup the correct fifoRkey
   wr.wr.rdma.rkey = comm->base.remDevs[ctsQp->remDevIdx].fifoRkey;
@@ -1982,17 +3439,120 @@ ncclResult_t ncclIbPostFifo(struct ncclIbRecvComm* comm, int n, void** data, int
   struct ibv_send_wr* bad_wr;
   NCCLCHECK(wrap_ibv_post_send(ctsQp->qp, &wr, &bad_wr));
   comm->remFifo.fifoTail++;
+  req->recv.ctsTime = ncclIbStatsDetail() ? clockNano() : 0;
   if (ib_stat_) ib_stat_->inc(ucommd::UNET_IB_FIFO_POST_COUNT);
 
   return ncclSuccess;
 }
 
+// CTS pacing, see SICL_UNET_IB_CTS_PACING
+static int64_t ncclIbCtsBudget(struct ncclIbMergedDev* mergedDev) {
+  int64_t bytes = siclParamUnetIbCtsGrantBytes();
+  // speed is in Mbps, i.e. bits per us, summed over the ports of the merged device
+  if (bytes < 0) bytes = (int64_t)__atomic_load_n(&mergedDev->speed, __ATOMIC_RELAXED) * siclParamUnetIbCtsGrantUs() / 8;
+  return bytes;
+}
+
+static void ncclIbCtsSetActive(struct ncclIbRecvComm* comm, int active) {
+  if (comm->ctsActive == active) return;
+  comm->ctsActive = active;
+  __atomic_add_fetch(&ncclIbDevs[comm->ctsDevN].ctsActive, active ? 1 : -1, __ATOMIC_RELAXED);
+}
+
+static bool ncclIbCtsAdmit(struct ncclIbRecvComm* comm, int64_t size) {
+  struct ncclIbDev* ibDev = ncclIbDevs + comm->ctsDevN;
+  if (comm->ctsGranted > 0) {
+    int64_t budget = ncclIbCtsBudget(ncclIbMergedDevs + comm->ctsMergedDev);
+    int active = std::max(1, __atomic_load_n(&ibDev->ctsActive, __ATOMIC_RELAXED));
+    if (comm->ctsGranted + size > budget / active) return false;
+    int64_t granted = __atomic_load_n(&ibDev->ctsGranted, __ATOMIC_RELAXED);
+    do {
+      if (granted + size > budget) return false;
+    } while (!__atomic_compare_exchange_n(&ibDev->ctsGranted, &granted, granted + size, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  } else {
+    __atomic_add_fetch(&ibDev->ctsGranted, size, __ATOMIC_ACQ_REL);
+  }
+  comm->ctsGranted += size;
+  if (ib_stat_) ib_stat_->add(ucommd::UNET_IB_CTS_GRANTED_BYTES, size);
+  return true;
+}
+
+static void ncclIbCtsRelease(struct ncclIbRecvComm* comm, int64_t size) {
+  __atomic_sub_fetch(&ncclIbDevs[comm->ctsDevN].ctsGranted, size, __ATOMIC_ACQ_REL);
+  comm->ctsGranted -= size;
+  if (ib_stat_) ib_stat_->sub(ucommd::UNET_IB_CTS_GRANTED_BYTES, size);
+}
+
+// Post the deferred CTS the budget allows, in order
+static ncclResult_t ncclIbCtsProgress(struct ncclIbRecvComm* comm) {
+  while (comm->ctsHead != comm->ctsTail) {
+    struct ncclIbCtsDeferred* e = comm->ctsQueue + comm->ctsHead%comm->base.maxRequests;
+    if (!ncclIbCtsAdmit(comm, e->req->recv.grant)) break;
+    NCCLCHECK(ncclIbPostFifo(comm, e->n, e->data, e->sizes, e->tags, e->mhandles, e->req, e->lane, e->nqps));
+    if (ib_stat_) ib_stat_->add(ucommd::UNET_IB_CTS_WAIT_US, (clockNano() - e->time) / 1000);
+    comm->ctsHead++;
+  }
+  ncclIbCtsSetActive(comm, comm->ctsGranted > 0 || comm->ctsHead != comm->ctsTail);
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclIbCtsPost(struct ncclIbRecvComm* comm, int n, void** data, int* sizes, int* tags, void** mhandles, struct ncclIbRequest* req, int lane, int nqps) {
+  req->recv.grant = 0;
+  for (int i = 0; i < n; i++) req->recv.grant += sizes[i];
+  NCCLCHECK(ncclIbCtsProgress(comm));
+  if (comm->ctsHead == comm->ctsTail && ncclIbCtsAdmit(comm, req->recv.grant)) {
+    NCCLCHECK(ncclIbPostFifo(comm, n, data, sizes, tags, mhandles, req, lane, nqps));
+  } else {
+    struct ncclIbCtsDeferred* e = comm->ctsQueue + comm->ctsTail%comm->base.maxRequests;
+    e->req = req;
+    e->n = n;
+    e->lane = lane;
+    e->nqps = nqps;
+    e->time = clockNano();
+    for (int i = 0; i < n; i++) {
+      e->data[i] = data[i];
+      e->sizes[i] = sizes[i];
+      e->tags[i] = tags[i];
+      e->mhandles[i] = mhandles[i];
+    }
+    comm->ctsTail++;
+    if (ib_stat_) ib_stat_->inc(ucommd::UNET_IB_CTS_DEFERRED);
+  }
+  ncclIbCtsSetActive(comm, 1);
+  return ncclSuccess;
+}
+
+// Scale-aware policy: once all QPs are up, stripe over the share of the QP
+// budget of our devices, re-computed when comms come and go. The recvs of the
+// next slot are posted with the new count, which its CTS advertises, so both
+// sides switch at that slot.
+static void ncclIbRecvQpsRebalance(struct ncclIbRecvComm* comm) {
+  struct ncclIbNetCommBase* base = &comm->base;
+  if (siclParamUnetIbQpPolicy() != 1 || base->lazy.state != ncclIbLazyStateDone) return;
+  int changed = 0, qpsPerDev = INT_MAX;
+  for (int i = 0; i < base->ndevs; i++) {
+    struct ncclIbDev* ibDev = ncclIbDevs + comm->devs[i].base.ibDevN;
+    int comms = __atomic_load_n(&ibDev->nComms, __ATOMIC_RELAXED);
+    if (comms != comm->qpsShareComms[i]) changed = 1;
+    comm->qpsShareComms[i] = comms;
+    qpsPerDev = std::min(qpsPerDev, ncclIbQpsShare(ibDev));
+  }
+  if (!changed) return;
+  int nqps = std::min(base->nqpsTarget, ncclIbRailQps(base, qpsPerDev));
+  if (nqps == base->nqps) return;
+  INFO(NCCL_NET, "UNET/IBV : peer rank %d QP share changed, nqps %d -> %d of %d", comm->peer_rank, base->nqps, nqps, base->nqpsTarget);
+  base->nqps = nqps;
+  base->qpIndex %= nqps;
+}
+
 ncclResult_t ncclIbIrecv(void* recvComm, int n, void** data, int* sizes, int* tags, void** mhandles, void** request) {
   struct ncclIbRecvComm* comm = (struct ncclIbRecvComm*)recvComm;
   if (comm->base.ready == 0) { WARN("UNET/IBV : ncclIbIrecv() called when comm->base.ready == 0"); return ncclInternalError; }
   if (comm->base.ready == 0) { *request = NULL; return ncclSuccess; }
-  if (n > NCCL_NET_IB_MAX_RECVS) return ncclInternalError;
+  if (n > comm->base.maxRecvs) return ncclInternalError;
   NCCLCHECK(ncclIbStatsCheckFatalCount(&comm->base.stats, __func__));
+  NCCLCHECK(ncclIbRecvLazyQpsProgress(comm));
+  ncclIbRecvQpsRebalance(comm);
 
   struct ncclIbRequest* req;
   NCCLCHECK(ncclIbGetRequest(&comm->base, &req));
@@ -2010,60 +3570,157 @@ ncclResult_t ncclIbIrecv(void* recvComm, int n, void** data, int* sizes, int* ta
   wr.sg_list = NULL;
   wr.num_sge = 0;
 
-  // Select either all QPs, or one qp per-device
-  const int nqps = ncclParamIbSplitDataOnQps() ? comm->base.nqps : comm->base.ndevs;
+  // Small receives take the latency lane, others all QPs or one qp per-rail
+  int lane = NCCL_IB_LANE_BULK;
+  if (comm->base.latLane) {
+    int64_t totalSize = 0;
+    for (int i = 0; i < n; i++) totalSize += sizes[i];
+    if (totalSize <= siclParamUnetIbLatThreshold()) lane = NCCL_IB_LANE_LAT;
+  }
 
-  // Post recvs
+  // Post recvs, the CTS advertises the QP count they were striped over
   struct ibv_recv_wr* bad_wr;
-  for (int i = 0; i < nqps; i++) {
-    struct ncclIbQp* qp = comm->base.qps + comm->base.qpIndex;
+  const int postNqps = comm->base.nqps;
+  if (lane == NCCL_IB_LANE_LAT) {
+    struct ncclIbQp* qp = &comm->base.latQp;
     ncclIbAddEvent(req, qp->devIndex, &comm->devs[qp->devIndex].base);
     NCCLCHECK(wrap_ibv_post_recv(qp->qp, &wr, &bad_wr));
-    comm->base.qpIndex = (comm->base.qpIndex+1)%comm->base.nqps;
+  } else {
+    const int nqps = ncclIbMsgQps(&comm->base);
+    for (int i = 0; i < nqps; i++) {
+      struct ncclIbQp* qp = comm->base.qps + comm->base.qpIndex;
+      ncclIbAddEvent(req, qp->devIndex, &comm->devs[qp->devIndex].base);
+      NCCLCHECK(wrap_ibv_post_recv(qp->qp, &wr, &bad_wr));
+      comm->base.qpIndex = (comm->base.qpIndex+1)%comm->base.nqps;
+    }
   }
 
   // Post to FIFO to notify sender
-  NCCLCHECK(ncclIbPostFifo(comm, n, data, sizes, tags, mhandles, req));
+  if (comm->ctsQueue) {
+    NCCLCHECK(ncclIbCtsPost(comm, n, data, sizes, tags, mhandles, req, lane, postNqps));
+  } else {
+    req->recv.grant = 0;
+    NCCLCHECK(ncclIbPostFifo(comm, n, data, sizes, tags, mhandles, req, lane, postNqps));
+  }
 
   *request = req;
   return ncclSuccess;
 }
 
+// Poll the shared flush CQ of a device and complete whichever requests the WRs
+// belong to, possibly of other comms.
+static ncclResult_t ncclIbFlushPoll(struct ncclIbDevFlush* flush, int* wrDone) {
+  struct ibv_wc wcs[4];
+  NCCLCHECK(wrap_ibv_poll_cq(flush->base.cq, 4, wcs, wrDone));
+  for (int w = 0; w < *wrDone; w++) {
+    struct ibv_wc *wc = wcs+w;
+    struct ncclIbRequest* req = (struct ncclIbRequest*)wc->wr_id;
+    __atomic_sub_fetch(&flush->inflight, 1, __ATOMIC_ACQ_REL);
+    if (wc->status != IBV_WC_SUCCESS) {
+      WARN("UNET/IBV : Got flush completion with status=%d opcode=%d vendor err %d hca %s",
+          wc->status, wc->opcode, wc->vendor_err, flush->base.pd->context->device->name);
+      if (ib_stat_) ib_stat_->inc(ucommd::UNET_IB_CPL_ERR_COUNT);
+      return ncclRemoteError;
+    }
+    if (ncclIbStatsDetail()) ib_stat_->inc(ucommd::UNET_IB_CPL_COUNT);
+    int devIndex = 0;
+    while (req->devBases[devIndex] != &flush->base) devIndex++;
+    // Completions of a QP are in order: flushDone[d] >= n means read n is done
+    __atomic_add_fetch(&((struct ncclIbRecvComm*)req->base)->flushDone[devIndex], 1, __ATOMIC_RELEASE);
+    ncclIbDoneFlushEvent(req, devIndex);
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclIbIflush(void* recvComm, int n, void** data, int* sizes, void** mhandles, void** request) {
   struct ncclIbRecvComm* comm = (struct ncclIbRecvComm*)recvComm;
   int last = -1;
   for (int i=0; i<n; i++) if (sizes[i]) last = i;
   if (comm->flushEnabled == 0 || last == -1) return ncclSuccess;
 
+  // A read through a device flushes every write that device made before it, so
+  // only read through the devices that delivered data since the last flush.
+  // Receives completed together share the flush posted for the first of them.
+  uint32_t flushMask = comm->flushPending;
+  comm->flushPending = 0;
+  if (flushMask == 0) {
+    uint32_t waitMask = 0;
+    for (int i = 0; i < comm->base.ndevs; i++) {
+      if (comm->flushPosted[i] > __atomic_load_n(&comm->flushDone[i], __ATOMIC_ACQUIRE)) waitMask |= 1U << i;
+    }
+    if (ib_stat_) ib_stat_->add(ucommd::UNET_IB_FLUSH_SAVED, comm->base.ndevs);
+    if (waitMask == 0) return ncclSuccess;
+
+    struct ncclIbRequest* req;
+    NCCLCHECK(ncclIbGetRequest(&comm->base, &req));
+    req->type = NCCL_NET_IB_REQ_FLUSH;
+    req->sock = &comm->base.sock;
+    req->flush.waitMask = waitMask;
+    for (int i = 0; i < comm->base.ndevs; i++) req->flush.waitSeq[i] = comm->flushPosted[i];
+    *request = req;
+    return ncclSuccess;
+  }
+
   // Only flush once using the last non-zero receive
   struct ncclIbRequest* req;
   NCCLCHECK(ncclIbGetRequest(&comm->base, &req));
   req->type = NCCL_NET_IB_REQ_FLUSH;
   req->sock = &comm->base.sock;
+  req->flush.waitMask = 0;
   struct ncclIbMrHandle* mhandle = (struct ncclIbMrHandle*) mhandles[last];
 
-  // We don't know which devIndex the recv was on, so we flush on all devices
-  for (int i = 0; i < comm->base.ndevs; i++) {
+  for (uint32_t mask = flushMask; mask; mask &= mask-1) {
+    int i = __builtin_ctz(mask);
+    struct ncclIbDevFlush* flush = ncclIbDevs[comm->devs[i].base.ibDevN].flush;
+    // Make room on the shared QP, completing other comms' flushes if needed
+    while (__atomic_add_fetch(&flush->inflight, 1, __ATOMIC_ACQ_REL) > flush->depth) {
+      __atomic_sub_fetch(&flush->inflight, 1, __ATOMIC_ACQ_REL);
+      int wrDone;
+      NCCLCHECK(ncclIbFlushPoll(flush, &wrDone));
+    }
+
     struct ibv_send_wr wr;
     memset(&wr, 0, sizeof(wr));
-    wr.wr_id = req - comm->base.reqs;
+    wr.wr_id = (uint64_t)req;
 
     wr.wr.rdma.remote_addr = (uint64_t)data[last];
     wr.wr.rdma.rkey = mhandle->mrs[i]->rkey;
-    wr.sg_list = &comm->devs[i].gpuFlush.sge;
+    wr.sg_list = &flush->sge;
     wr.num_sge = 1;
     wr.opcode = IBV_WR_RDMA_READ;
     wr.send_flags = IBV_SEND_SIGNALED;
 
+    // The completion may be polled by another thread as soon as the WR is posted
+    ncclIbAddFlushEvent(req, i, &flush->base);
+    comm->flushPosted[i]++;
     struct ibv_send_wr* bad_wr;
-    NCCLCHECK(wrap_ibv_post_send(comm->devs[i].gpuFlush.qp.qp, &wr, &bad_wr));
-    ncclIbAddEvent(req, i, &comm->devs[i].base);
+    NCCLCHECK(wrap_ibv_post_send(flush->qp.qp, &wr, &bad_wr));
+  }
+  if (ib_stat_) {
+    int nReads = __builtin_popcount(flushMask);
+    ib_stat_->add(ucommd::UNET_IB_FLUSH_READS, nReads);
+    ib_stat_->add(ucommd::UNET_IB_FLUSH_SAVED, comm->base.ndevs - nReads);
   }
 
   *request = req;
   return ncclSuccess;
 }
 
+// Progress a flush that rides on earlier flushes of its comm, clearing waitMask
+// once those have completed
+static ncclResult_t ncclIbFlushWait(struct ncclIbRequest* r) {
+  struct ncclIbRecvComm* comm = (struct ncclIbRecvComm*)r->base;
+  for (uint32_t mask = r->flush.waitMask; mask; mask &= mask-1) {
+    int i = __builtin_ctz(mask);
+    if (__atomic_load_n(&comm->flushDone[i], __ATOMIC_ACQUIRE) < r->flush.waitSeq[i]) {
+      int wrDone;
+      NCCLCHECK(ncclIbFlushPoll(ncclIbDevs[comm->devs[i].base.ibDevN].flush, &wrDone));
+    }
+    if (__atomic_load_n(&comm->flushDone[i], __ATOMIC_ACQUIRE) >= r->flush.waitSeq[i]) r->flush.waitMask &= ~(1U << i);
+  }
+  return ncclSuccess;
+}
+
 #define HCA_NAME(req, index) ((req)->devBases[(index)]->pd->context->device->name)
 
 ncclResult_t ncclIbTest(void* request, int* done, int* sizes) {
@@ -2071,7 +3728,13 @@ ncclResult_t ncclIbTest(void* request, int* done, int* sizes) {
   *done = 0;
   while (1) {
     NCCLCHECK(ncclIbStatsCheckFatalCount(&r->base->stats, __func__));
-    if (r->events[0] == 0 && r->events[1] == 0) {
+    struct ncclIbRecvComm* rComm = r->base->isSend ? NULL : (struct ncclIbRecvComm*)r->base;
+    if (rComm && rComm->ctsHead != rComm->ctsTail) NCCLCHECK(ncclIbCtsProgress(rComm));
+    if (r->type == NCCL_NET_IB_REQ_FLUSH && r->flush.waitMask) {
+      NCCLCHECK(ncclIbFlushWait(r));
+      if (r->flush.waitMask) return ncclSuccess;
+    }
+    if (__atomic_load_n(&r->eventMask, __ATOMIC_ACQUIRE) == 0) {
       TRACE(NCCL_NET, "UNET/IBV : r=%p done", r);
       *done = 1;
       if (sizes && r->type == NCCL_NET_IB_REQ_RECV) {
@@ -2080,7 +3743,18 @@ ncclResult_t ncclIbTest(void* request, int* done, int* sizes) {
       if (sizes && r->type == NCCL_NET_IB_REQ_SEND) {
         sizes[0] = r->send.size;
       }
+      int64_t grant = (r->type == NCCL_NET_IB_REQ_RECV) ? r->recv.grant : 0;
+      if (ib_stat_ && r->time && r->type != NCCL_NET_IB_REQ_FLUSH) {
+        uint64_t lat = ncclIbTicksToNs(ncclIbTicks() - r->time);
+        ib_stat_->record(ucommd::UNET_IB_REQ_LAT_NS, lat);
+        if (r->base->latStat) r->base->latStat->record(r->type == NCCL_NET_IB_REQ_SEND ? ucommd::UNET_LAT_SEND_NS : ucommd::UNET_LAT_RECV_NS, lat);
+      }
       NCCLCHECK(ncclIbFreeRequest(r));
+      if (grant) {
+        // The data arrived, give the budget to the next CTS
+        ncclIbCtsRelease(rComm, grant);
+        NCCLCHECK(ncclIbCtsProgress(rComm));
+      }
       return ncclSuccess;
     }
 
@@ -2088,71 +3762,89 @@ ncclResult_t ncclIbTest(void* request, int* done, int* sizes) {
     int wrDone = 0;
     struct ibv_wc wcs[4];
 
-    for (int i = 0; i < NCCL_IB_MAX_DEVS_PER_NIC; i++) {
-      // If we expect any completions from this device's CQ
-      if (r->events[i]) {
-        NCCLCHECK(wrap_ibv_poll_cq(r->devBases[i]->cq, 4, wcs, &wrDone));
+    // Only poll the devices we expect completions from
+    for (uint32_t mask = __atomic_load_n(&r->eventMask, __ATOMIC_ACQUIRE); mask; mask &= mask-1) {
+      int i = __builtin_ctz(mask);
+      if (r->type == NCCL_NET_IB_REQ_FLUSH) {
+        struct ncclIbDevFlush* flush = ncclIbDevs[r->devBases[i]->ibDevN].flush;
+        NCCLCHECK(ncclIbFlushPoll(flush, &wrDone));
         totalWrDone += wrDone;
-        if (wrDone == 0) continue;
-        for (int w=0; w<wrDone; w++) {
-          struct ibv_wc *wc = wcs+w;
-          if (wc->status != IBV_WC_SUCCESS) {
-            union ncclSocketAddress addr;
-            ncclSocketGetAddr(r->sock, &addr);
-            char localGidString[INET6_ADDRSTRLEN] = "";
-            char remoteGidString[INET6_ADDRSTRLEN] = "";
-            const char* localGidStr = NULL, *remoteGidStr = NULL;
-            if (r->devBases[i]->gidInfo.link_layer == IBV_LINK_LAYER_ETHERNET) {
-              localGidStr = inet_ntop(AF_INET6, &r->devBases[i]->gidInfo.localGid, localGidString, sizeof(localGidString));
-              remoteGidStr = inet_ntop(AF_INET6, &r->base->remDevs[i].remoteGid, remoteGidString, sizeof(remoteGidString));
-            }
-
-            char line[SOCKET_NAME_MAXLEN+1];
-            char *hcaName = r->devBases[i]->pd->context->device->name;
-            WARN("UNET/IBV : Got completion from peer %s with status=%d opcode=%d len=%d vendor err %d (%s)%s%s%s%s hca %s",
-                ncclSocketToString(&addr, line), wc->status, wc->opcode, wc->byte_len, wc->vendor_err, reqTypeStr[r->type],
-                localGidStr ?  " localGid ":"", localGidString, remoteGidStr ? " remoteGids":"", remoteGidString, hcaName);
-            if (ib_stat_) ib_stat_->inc(ucommd::UNET_IB_CPL_ERR_COUNT);
-            return ncclRemoteError;
-          }
-
+        NCCLCHECK(ncclIbStatsCheckFatalCount(&ncclIbDevs[r->devBases[i]->ibDevN].stats,__func__));
+        continue;
+      }
+      NCCLCHECK(wrap_ibv_poll_cq(r->devBases[i]->cq, 4, wcs, &wrDone));
+      totalWrDone += wrDone;
+      if (wrDone == 0) continue;
+      for (int w=0; w<wrDone; w++) {
+        struct ibv_wc *wc = wcs+w;
+        if (wc->status != IBV_WC_SUCCESS) {
           union ncclSocketAddress addr;
           ncclSocketGetAddr(r->sock, &addr);
-          struct ncclIbRequest* req = r->base->reqs+(wc->wr_id & 0xff);
+          char localGidString[INET6_ADDRSTRLEN] = "";
+          char remoteGidString[INET6_ADDRSTRLEN] = "";
+          const char* localGidStr = NULL, *remoteGidStr = NULL;
+          if (r->devBases[i]->gidInfo.link_layer == IBV_LINK_LAYER_ETHERNET) {
+            localGidStr = inet_ntop(AF_INET6, &r->devBases[i]->gidInfo.localGid, localGidString, sizeof(localGidString));
+            remoteGidStr = inet_ntop(AF_INET6, &r->base->remDevs[i].remoteGid, remoteGidString, sizeof(remoteGidString));
+          }
 
-          #ifdef ENABLE_TRACE
           char line[SOCKET_NAME_MAXLEN+1];
-          TRACE(NCCL_NET, "UNET/IBV : Got completion from peer %s with status=%d opcode=%d len=%d wr_id=%d r=%p type=%d events={%d,%d}, i=%d",
-              ncclSocketToString(&addr, line), wc->status, wc->opcode, wc->byte_len, wc->wr_id, req, req->type, req->events[0], req->events[1], i);
-          #endif
-          if (ib_stat_) ib_stat_->inc(ucommd::UNET_IB_CPL_COUNT);
-          if (req && req->type == NCCL_NET_IB_REQ_SEND) {
-            for (int j = 0; j < req->nreqs; j++) {
-              struct ncclIbRequest* sendReq = r->base->reqs+((wc->wr_id >> (j*8)) & 0xff);
-              if ((sendReq->events[i] <= 0)) {
-                WARN("UNET/IBV : sendReq(%p)->events={%d,%d}, i=%d, j=%d <= 0", sendReq, sendReq->events[0], sendReq->events[1], i, j);
-                return ncclInternalError;
-              }
-              sendReq->events[i]--;
+          char *hcaName = r->devBases[i]->pd->context->device->name;
+          WARN("UNET/IBV : Got completion from peer %s with status=%d opcode=%d len=%d vendor err %d (%s)%s%s%s%s hca %s",
+              ncclSocketToString(&addr, line), wc->status, wc->opcode, wc->byte_len, wc->vendor_err, reqTypeStr[r->type],
+              localGidStr ?  " localGid ":"", localGidString, remoteGidStr ? " remoteGids":"", remoteGidString, hcaName);
+          if (ib_stat_) ib_stat_->inc(ucommd::UNET_IB_CPL_ERR_COUNT);
+          return ncclRemoteError;
+        }
+
+        #ifdef ENABLE_TRACE
+        union ncclSocketAddress addr;
+        ncclSocketGetAddr(r->sock, &addr);
+        char line[SOCKET_NAME_MAXLEN+1];
+        TRACE(NCCL_NET, "UNET/IBV : Got completion from peer %s with status=%d opcode=%d len=%d wr_id=%ld r=%p type=%d eventMask=0x%x, i=%d",
+            ncclSocketToString(&addr, line), wc->status, wc->opcode, wc->byte_len, wc->wr_id, r, r->type, r->eventMask, i);
+        #endif
+        if (ncclIbStatsDetail()) ib_stat_->inc(ucommd::UNET_IB_CPL_COUNT);
+        if (r->base->isSend) {
+          // Send completions carry a completion tag, see ncclIbMultiSend
+          struct ncclIbSendComm* sComm = (struct ncclIbSendComm*)r->base;
+          struct ncclIbCplTag* tag = sComm->cplTags + wc->wr_id;
+          for (int j = 0; j < tag->nreqs; j++) {
+            struct ncclIbRequest* sendReq = tag->reqs[j];
+            if ((sendReq->events[i] <= 0)) {
+              WARN("UNET/IBV : sendReq(%p)->events[%d]=%d (eventMask 0x%x), j=%d <= 0", sendReq, i, sendReq->events[i], sendReq->eventMask, j);
+              return ncclInternalError;
             }
-            if (bw_stat_) bw_stat_->add(ucommd::UNET_BW_CPL_BYTES_BY_RANK(req->peer_rank), req->send.size);
-          } else {
-            if (req && wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
-              if (req->type != NCCL_NET_IB_REQ_RECV) {
-                WARN("UNET/IBV : wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM and req->type=%d", req->type);
-                return ncclInternalError;
-              }
-              if (req->nreqs == 1) {
-                req->recv.sizes[0] = wc->imm_data;
-              }
+            ncclIbDoneEvent(sendReq, i);
+          }
+          if (bw_stat_ && sComm->bwPeer >= 0 && ucommd::unetStatsDetailed()) bw_stat_->add(ucommd::UNET_BW_CPL_BYTES(sComm->bwPeer), tag->reqs[0]->send.size);
+          tag->refs--;
+        } else {
+          struct ncclIbRequest* req = r->base->reqs + wc->wr_id;
+          if (req && wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+            if (req->type != NCCL_NET_IB_REQ_RECV) {
+              WARN("UNET/IBV : wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM and req->type=%d", req->type);
+              return ncclInternalError;
+            }
+            if (req->nreqs == 1) {
+              req->recv.sizes[0] = wc->imm_data;
+            }
+            // The data written before the immediate came through this device
+            ((struct ncclIbRecvComm*)req->base)->flushPending |= 1U << i;
+            if (req->recv.ctsTime) {
+              // First data of the request, count how late the sender was
+              uint64_t late = clockNano() - req->recv.ctsTime;
+              ib_stat_->record(ucommd::UNET_IB_DATA_LATE_NS, late);
+              if (bw_stat_ && rComm->bwPeer >= 0) bw_stat_->add(ucommd::UNET_BW_DATA_LATE_NS(rComm->bwPeer), late);
+              req->recv.ctsTime = 0;
             }
-            req->events[i]--;
           }
+          ncclIbDoneEvent(req, i);
         }
-        // Once the IB fatal event is reported in the async thread, we want to propagate this error
-        // to communicator and prevent further polling to reduce error pollution.
-        NCCLCHECK(ncclIbStatsCheckFatalCount(&ncclIbDevs[r->devBases[i]->ibDevN].stats,__func__));
       }
+      // Once the IB fatal event is reported in the async thread, we want to propagate this error
+      // to communicator and prevent further polling to reduce error pollution.
+      NCCLCHECK(ncclIbStatsCheckFatalCount(&ncclIbDevs[r->devBases[i]->ibDevN].stats,__func__));
     }
 
     // If no CQEs found on any device, return and come back later
@@ -2165,11 +3857,20 @@ ncclResult_t ncclIbCloseSend(void* sendComm) {
   if (comm) {
     NCCLCHECK(ncclSocketClose(&comm->base.sock));
 
-    for (int q = 0; q < comm->base.nqps; q++)
+    if (comm->base.ready) {
+      char line[256];
+      int len = snprintf(line, sizeof(line), "local");
+      for (int i = 0; i < comm->base.ndevs; i++) len += snprintf(line+len, sizeof(line)-len, " %lu", comm->railBytes[i]);
+      len += snprintf(line+len, sizeof(line)-len, " remote");
+      for (int i = 0; i < comm->base.nRemDevs; i++) len += snprintf(line+len, sizeof(line)-len, " %lu", comm->remRailBytes[i]);
+      INFO(NCCL_NET, "UNET/IBV : peer rank %d rail bytes %s", comm->peer_rank, line);
+    }
+
+    for (int q = 0; q < comm->base.nqpsTarget; q++)
       if (comm->base.qps[q].qp != NULL) {
-        NCCLCHECK(wrap_ibv_destroy_qp(comm->base.qps[q].qp));
-        if (ib_stat_) ib_stat_->dec(ucommd::UNET_IB_QP_COUNT);
+        NCCLCHECK(ncclIbDestroyQp(&comm->devs[comm->base.qps[q].devIndex].base, comm->base.qps + q));
       }
+    if (comm->base.latQp.qp != NULL) NCCLCHECK(ncclIbDestroyQp(&comm->devs[comm->base.latQp.devIndex].base, &comm->base.latQp));
 
     for (int i = 0; i < comm->base.ndevs; i++) {
       struct ncclIbSendCommDev* commDev = comm->devs + i;
@@ -2177,6 +3878,8 @@ ncclResult_t ncclIbCloseSend(void* sendComm) {
       if (comm->remSizesFifo.mrs[i] != NULL) NCCLCHECK(wrap_ibv_dereg_mr(comm->remSizesFifo.mrs[i]));
       NCCLCHECK(ncclIbDestroyBase(&commDev->base));
     }
+    if (comm->base.lazy.buffer) free(comm->base.lazy.buffer);
+    ncclIbSendCommFreeCtrl(comm);
     free(comm);
   }
   return ncclSuccess;
@@ -2187,25 +3890,25 @@ ncclResult_t ncclIbCloseRecv(void* recvComm) {
   if (comm) {
     NCCLCHECK(ncclSocketClose(&comm->base.sock));
 
-    for (int q = 0; q < comm->base.nqps; q++)
+    for (int q = 0; q < comm->base.nqpsTarget; q++)
       if (comm->base.qps[q].qp != NULL) {
-        NCCLCHECK(wrap_ibv_destroy_qp(comm->base.qps[q].qp));
-        if (ib_stat_) ib_stat_->dec(ucommd::UNET_IB_QP_COUNT);
+        NCCLCHECK(ncclIbDestroyQp(&comm->devs[comm->base.qps[q].devIndex].base, comm->base.qps + q));
       }
+    if (comm->base.latQp.qp != NULL) NCCLCHECK(ncclIbDestroyQp(&comm->devs[comm->base.latQp.devIndex].base, &comm->base.latQp));
 
     for (int i = 0; i < comm->base.ndevs; i++) {
       struct ncclIbRecvCommDev* commDev = comm->devs + i;
-      if (comm->flushEnabled) {
-        if (commDev->gpuFlush.qp.qp != NULL) {
-          NCCLCHECK(wrap_ibv_destroy_qp(commDev->gpuFlush.qp.qp));
-          if (ib_stat_) ib_stat_->dec(ucommd::UNET_IB_QP_COUNT);
-        }
-        if (commDev->gpuFlush.hostMr != NULL) NCCLCHECK(wrap_ibv_dereg_mr(commDev->gpuFlush.hostMr));
-      }
+      if (comm->flushEnabled) NCCLCHECK(ncclIbFlushRelease(commDev->base.ibDevN));
       if (commDev->fifoMr != NULL) NCCLCHECK(wrap_ibv_dereg_mr(commDev->fifoMr));
       if (commDev->sizesFifoMr != NULL) NCCLCHECK(wrap_ibv_dereg_mr(commDev->sizesFifoMr));
       NCCLCHECK(ncclIbDestroyBase(&commDev->base));
     }
+    if (comm->base.lazy.buffer) free(comm->base.lazy.buffer);
+    if (comm->ctsQueue) {
+      if (comm->ctsGranted) ncclIbCtsRelease(comm, comm->ctsGranted);
+      ncclIbCtsSetActive(comm, 0);
+    }
+    ncclIbRecvCommFreeCtrl(comm);
     free(comm);
   }
   return ncclSuccess;
@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) 2024, Scitix Tech PTE. LTD. All rights reserved.
+ *
+ * See LICENSE file in the root directory of this source tree for terms.
+ */
+
+// Cost of Stat::inc/add when several threads update the same counters, as
+// proxy threads do with cpl_count and the per-rank cpl bytes, with the
+// counters on one shard and spread over several.
+//
+//   sicl_stats_bench [threads] [iterations per thread]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "stats.h"
+
+using namespace ucommd;
+
+namespace {
+
+constexpr size_t kCounters = 4;
+
+// Wall ns of the run, every thread doing iters inc and iters add
+double run(size_t num_shards, int threads, size_t iters) {
+  auto stride = Stat::shardStride(kCounters, num_shards);
+  std::vector<size_t> buffer(stride * num_shards + Stat::kShardAlign / sizeof(size_t), 0);
+  // Shards start on a cache line, as in the shm
+  auto addr = ((uintptr_t)buffer.data() + Stat::kShardAlign - 1) / Stat::kShardAlign * Stat::kShardAlign;
+  Stat stat(0, (Counter*)addr, kCounters, num_shards);
+
+  std::atomic<int> ready{0};
+  std::atomic<bool> go{false};
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&] {
+      ready.fetch_add(1);
+      while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+      for (size_t n = 0; n < iters; n++) {
+        stat.inc(0);
+        stat.add(1, 64);
+      }
+    });
+  }
+  while (ready.load() != threads) std::this_thread::yield();
+  auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto& w : workers) w.join();
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+
+  size_t count = 0, bytes = 0;
+  stat.get(0, count);
+  stat.get(1, bytes);
+  if (count != threads * iters || bytes != threads * iters * 64) {
+    fprintf(stderr, "shards=%zu: lost updates, count %zu bytes %zu\n", num_shards, count, bytes);
+    exit(1);
+  }
+  return (double)ns;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int threads = argc > 1 ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+  size_t iters = argc > 2 ? strtoull(argv[2], nullptr, 0) : 10000000;
+  if (threads <= 0) threads = 1;
+  printf("%d threads, %zu inc + %zu add each, %u cpus\n", threads, iters, iters,
+      std::thread::hardware_concurrency());
+  // Per thread, the cost of an update as the thread sees it. All threads, the
+  // wall time over every update done, which only drops below the per thread
+  // cost when the threads actually run in parallel.
+  printf("%-10s %16s %16s\n", "", "ns/op per thread", "ns/op all");
+  for (size_t shards : {1, 8}) {
+    double ns = run(shards, threads, iters);
+    printf("shards=%-3zu %16.2f %16.2f\n", shards, ns / (2 * iters), ns / (2 * iters * threads));
+  }
+  return 0;
+}
@@ -24,13 +24,17 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <map>
+#include <tuple>
 #include <chrono>
+#include <algorithm>
 #include <sstream>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
 
 #include "stats.h"
+#include "ucommd.h"
 #include "logger.h"
 #include "monitor.h"
 
@@ -194,12 +198,23 @@ int Monitor::check_stats(StatsShmInfo& info) {
     LogDebug("invalid size=%d of %s", st_buff.st_size, file_path.c_str());
     return 1;
   }
-  auto fd = open(file_path.c_str(), O_RDONLY, (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+  // Read-only when we may not write, the process then keeps its detailed
+  // counters off as it does not know we watch
+  info.writable = true;
+  auto fd = open(file_path.c_str(), O_RDWR, (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+  if (fd == -1) {
+    info.writable = false;
+    fd = open(file_path.c_str(), O_RDONLY, (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+    if (fd != -1) {
+      LogWarn("%s is read-only to us, a process with SICL_UCOMMD_STATS_GATE=1 keeps "
+          "its histograms and completion counters frozen", file_path.c_str());
+    }
+  }
   if (fd == -1) {
     LogDebug("failed to open shm file %s, err=%d", file_path.c_str(), errno);
     return 1;
   }
-  void* addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  void* addr = mmap(NULL, size, info.writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
   if (addr == MAP_FAILED) {
     LogDebug("failed to mmap shm file %s, err=%d", file_path.c_str(), errno);
     close(fd);
@@ -218,15 +233,105 @@ int Monitor::check_stats(StatsShmInfo& info) {
   auto desc = (StatsShm::Desc*)(meta + 1);
   for (int i = 0; i < meta->counter_num; i++) {
     info.desc.push_back((desc+i)->name);
+    info.kind.push_back((desc+i)->kind);
+  }
+  if (meta->hist_buckets && (meta->hist_buckets != (int)Histogram::kBuckets ||
+      meta->hist_sub_bits != Histogram::kSubBits)) {
+    LogWarn("unsupported histograms in %s: %d buckets, %d sub bits",
+        info.shm.c_str(), meta->hist_buckets, meta->hist_sub_bits);
+    (void)munmap(addr, size);
+    return 1;
   }
 
   info.data = (volatile size_t*)(desc + meta->counter_num);
   info.counter_num = meta->counter_num;
   info.stat_num = meta->stat_num;
+  info.shard_num = meta->shard_num > 0 ? meta->shard_num : 1;
+  info.shard_stride = meta->shard_stride > 0 ? meta->shard_stride : meta->counter_num;
+  if (meta->snap_offset > 0) {
+    info.snap_data = (const char*)addr + meta->snap_offset;
+    info.snap_stride = meta->snap_stride;
+    info.snap.resize(info.stat_num * info.counter_num);
+    info.snap_time.resize(info.stat_num);
+  }
+  if (meta->ring_len > 0) {
+    info.ring_data = (const char*)addr + meta->ring_entry_offset;
+    info.ring_stride = meta->ring_stride;
+    info.ring_len = meta->ring_len;
+    info.ring_interval_ms = meta->ring_interval_ms;
+    auto indices = (const int*)((const char*)addr + meta->ring_offset);
+    info.ring_counters.assign(indices, indices + meta->ring_counter_num);
+    info.ring_head = &meta->ring_head;
+  }
 
   return 0;
 }
 
+void Monitor::StatsShmInfo::refresh() {
+  if (!snap_data) return;
+  for (size_t i = 0; i < stat_num; i++) {
+    auto s = (const StatsShm::Snapshot*)(snap_data + i * snap_stride);
+    if (StatsShm::readSnapshot(s, counter_num, snap.data() + i * counter_num, &snap_time[i])) {
+      LogDebug("snapshot %zu of %s kept changing, keeping the previous one", i, shm.c_str());
+    }
+  }
+}
+
+std::string Monitor::StatsShmInfo::percentiles(size_t i, size_t j) const {
+  static auto human_string = [](size_t val)->std::string {
+    static std::string units[5] = {"", "K", "M", "G", "T"};
+    int index = 0;
+    while (val >= 10000 && index < 4) {
+      val /= 1000;
+      index++;
+    }
+    return std::to_string(val) + units[index];
+  };
+  std::vector<size_t> buckets(Histogram::kBuckets);
+  for (size_t b = 0; b < Histogram::kBuckets; b++) {
+    buckets[b] = value(i, j + 1 + b);
+  }
+  std::string str;
+  for (auto q : {0.5, 0.9, 0.99}) {
+    if (!str.empty()) str += "/";
+    str += human_string(Histogram::percentile(buckets.data(), q));
+  }
+  return str;
+}
+
+void Monitor::mark_read(int interval_ms) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  for (auto& stats : stats_records_) {
+    for (auto& info : stats.second) {
+      if (info.writable) StatsShm::markRead((StatsShm::Meta*)info.addr, now, interval_ms);
+    }
+  }
+}
+
+void Monitor::StatsShmInfo::read_ring(std::vector<uint64_t>& times, std::vector<size_t>& values) const {
+  times.clear();
+  values.clear();
+  if (!ring_data) return;
+  size_t num = stat_num * ring_counters.size();
+  uint64_t head = __atomic_load_n(ring_head, __ATOMIC_ACQUIRE);
+  uint64_t first = head > ring_len ? head - ring_len : 0;
+  std::vector<size_t> entry(num);
+  for (uint64_t n = first; n < head; n++) {
+    auto snap = (const StatsShm::Snapshot*)(ring_data + (n % ring_len) * ring_stride);
+    uint64_t time_ns;
+    if (StatsShm::readSnapshot(snap, num, entry.data(), &time_ns)) break;
+    times.push_back(time_ns);
+    values.insert(values.end(), entry.begin(), entry.end());
+  }
+  // Drop the entries the sampler may have taken again while we read
+  uint64_t now_head = __atomic_load_n(ring_head, __ATOMIC_ACQUIRE);
+  size_t stale = now_head > first + ring_len ? std::min<size_t>(now_head - first - ring_len, times.size()) : 0;
+  times.erase(times.begin(), times.begin() + stale);
+  values.erase(values.begin(), values.begin() + stale * num);
+}
+
 void Monitor::clean_stats() {
   for (auto it = stats_records_.begin(); it != stats_records_.end(); ) {
     for (auto iit = it->second.begin(); iit != it->second.end(); ) {
@@ -247,8 +352,12 @@ void Monitor::clean_stats() {
 
 void Monitor::bw_print_func() {
   static size_t world_size_ = 0, local_world_size_ = 0;
-  static std::unordered_map<int, std::unordered_map<int, std::vector<size_t>>> unprinted_;
+  static std::unordered_map<int, std::map<int, std::vector<size_t>>> unprinted_;
   static std::unordered_map<int, std::unordered_map<int, size_t>> prev_post_map_, prev_cql_map_;
+  // Time waited on each peer since the last print, as a receiver and a sender
+  static std::unordered_map<int, std::map<int, size_t>> cts_late_, data_late_;
+  static std::unordered_map<int, std::unordered_map<int, size_t>> prev_cts_late_, prev_data_late_;
+  static std::unordered_map<int, uint64_t> prev_snap_time_;
   static std::unordered_map<int, int> local2globalrank_, localrank2pid_;
   static size_t now_get_ns_, prev_get_ns_, duration_, prev_print_ns_;
   static auto human_string = [](size_t bytes)->std::string {
@@ -266,64 +375,313 @@ void Monitor::bw_print_func() {
   duration_ = now_get_ns_ - prev_get_ns_;
   if (duration_ < 1000000) return;
   prev_get_ns_ = now_get_ns_;
-  for (const auto& stats : stats_records_) {
+  for (auto& stats : stats_records_) {
     if (stats.first != "unet_bw_stats") {
       continue;
     }
 
-    for (const auto& info : stats.second) {
+    for (auto& info : stats.second) {
+      info.refresh();
       for (size_t i = 0; i < info.stat_num; i++) {
-        auto base = info.data + i * info.counter_num;
-        int pid = base[0];
-        int rank = base[1];
-        int local_rank = base[2];
-        if (world_size_ != base[3] || local_world_size_ != base[4]) {
-          world_size_ = base[3];
-          local_world_size_ = base[4];
+        auto base = [&info, i](size_t j) { return info.value(i, j); };
+        int pid = base(UNET_BW_PID);
+        int rank = base(UNET_BW_RANK);
+        int local_rank = base(UNET_BW_LOCAL_RANK);
+        if (world_size_ != base(UNET_BW_WORLD_SIZE) || local_world_size_ != base(UNET_BW_LOCAL_SIZE)) {
+          world_size_ = base(UNET_BW_WORLD_SIZE);
+          local_world_size_ = base(UNET_BW_LOCAL_SIZE);
           unprinted_.clear();
           prev_post_map_.clear();
           prev_cql_map_.clear();
+          cts_late_.clear();
+          data_late_.clear();
+          prev_cts_late_.clear();
+          prev_data_late_.clear();
+          prev_snap_time_.clear();
           local2globalrank_.clear();
           localrank2pid_.clear();
         }
         local2globalrank_[local_rank] = rank;
         localrank2pid_[local_rank] = pid;
 
-        for (size_t i = 0; i < world_size_; i++) {
-          if (prev_cql_map_[local_rank][i] == base[2 * i + 6]) {
+        // Rates of snapshots are over the time between their copies, the
+        // first snapshot of a rank only sets the baselines
+        auto duration = duration_;
+        bool baseline = false;
+        if (auto snap_time = info.value_time(i)) {
+          if (snap_time == prev_snap_time_[local_rank]) continue;
+          baseline = prev_snap_time_[local_rank] == 0;
+          duration = snap_time - prev_snap_time_[local_rank];
+          prev_snap_time_[local_rank] = snap_time;
+        }
+
+        // Walk the peer table up to the last peer in use
+        size_t peer_cap = base(UNET_BW_PEER_CAP), peer_num = base(UNET_BW_PEER_NUM);
+        for (size_t slot = 0, found = 0; slot < peer_cap && found < peer_num; slot++) {
+          auto peer = UNET_BW_PEER(slot);
+          auto key = base(peer + UNET_BW_PEER_KEY);
+          if (key == 0) continue;
+          found++;
+          int i = key - 1;
+          auto cts_late = base(UNET_BW_CTS_LATE_NS(peer));
+          auto data_late = base(UNET_BW_DATA_LATE_NS(peer));
+          auto cpl = base(UNET_BW_CPL_BYTES(peer));
+          if (baseline) {
+            prev_cts_late_[local_rank][i] = cts_late;
+            prev_data_late_[local_rank][i] = data_late;
+            prev_cql_map_[local_rank][i] = cpl;
+            continue;
+          }
+          if (prev_cts_late_[local_rank][i] != cts_late) {
+            cts_late_[local_rank][i] += cts_late - prev_cts_late_[local_rank][i];
+            prev_cts_late_[local_rank][i] = cts_late;
+          }
+          if (prev_data_late_[local_rank][i] != data_late) {
+            data_late_[local_rank][i] += data_late - prev_data_late_[local_rank][i];
+            prev_data_late_[local_rank][i] = data_late;
+          }
+          if (prev_cql_map_[local_rank][i] == cpl) {
             continue;
           }
-          unprinted_[local_rank][i].push_back((base[2 * i + 6] - prev_cql_map_[local_rank][i]) * 1000000000 / duration_);
-          prev_cql_map_[local_rank][i] = base[2 * i + 6];
+          unprinted_[local_rank][i].push_back((cpl - prev_cql_map_[local_rank][i]) * 1000000000 / duration);
+          prev_cql_map_[local_rank][i] = cpl;
         }
       }
     }
   }
 
   if ((now_get_ns_ - prev_print_ns_) > 1000000000) {
+    auto print_ns = now_get_ns_ - prev_print_ns_;
     prev_print_ns_ = now_get_ns_;
+    // Microseconds waited on each peer per second
+    auto print_late = [print_ns](const char* what, const std::map<int, size_t>& late) {
+      if (late.empty()) return;
+      std::cout << "         [" << what << "] ";
+      for (const auto& peer : late) {
+        std::cout << "[" << peer.first << "]=" << peer.second * 1000000 / print_ns << "us/s ";
+      }
+      std::cout << std::endl << std::flush;
+    };
 
     std::cout << std::endl << "=========================" << std::endl << std::flush;
     print_real_time();
     for (size_t i = 0; i < local_world_size_; i++) {
       std::cout << "[" << i << "][" << local2globalrank_[i] << "][" << localrank2pid_[i] << "]"
                 << "[tx_thruput_to_rank] ";
-      for (size_t j = 0; j < world_size_; j++) {
-        if (!unprinted_[i][j].empty()) {
+      for (const auto& peer : unprinted_[i]) {
+        if (!peer.second.empty()) {
           size_t total_thruput = 0, total_num = 0;
-          // for (auto& e : unprinted_[i][j]) max_bw = std::max(max_bw, e);
-          for (auto& e : unprinted_[i][j]) {
+          for (auto& e : peer.second) {
             total_thruput += e; total_num++;
           }
-          std::cout << "[" << j << "]=" << human_string(total_thruput / total_num) << "/s ";
+          std::cout << "[" << peer.first << "]=" << human_string(total_thruput / total_num) << "/s ";
         }
       }
       std::cout << std::endl << std::flush;
+      print_late("cts_late_from_rank", cts_late_[i]);
+      print_late("data_late_from_rank", data_late_[i]);
     }
     unprinted_.clear();
+    cts_late_.clear();
+    data_late_.clear();
   }
 }
 
+void Monitor::rail_print_func() {
+  struct Rail {
+    size_t tx_bytes = 0;
+    uint64_t time_ns = 0;
+  };
+  static std::unordered_map<int, std::map<int, Rail>> prev_;
+  static auto human_string = [](size_t bytes)->std::string {
+    static std::string units[5] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int index = 0;
+    while (bytes > 10240 && index < 4) {
+      bytes /= 1024;
+      index++;
+    }
+    return std::to_string(bytes) + units[index];
+  };
+
+  uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  // Tx rates of the devices of each process, keyed by pid then device
+  std::map<int, std::map<int, size_t>> rates;
+  std::unordered_map<int, int> ranks;
+  for (auto& stats : stats_records_) {
+    if (stats.first != "unet_rail_stats") {
+      continue;
+    }
+    for (auto& info : stats.second) {
+      info.refresh();
+      for (size_t i = 0; i < info.stat_num; i++) {
+        int pid = info.value(i, UNET_RAIL_PID);
+        if (pid == 0) continue;
+        int dev = info.value(i, UNET_RAIL_DEV);
+        ranks[pid] = info.value(i, UNET_RAIL_RANK);
+        Rail cur;
+        cur.tx_bytes = info.value(i, UNET_RAIL_TX_BYTES);
+        cur.time_ns = info.value_time(i) ? info.value_time(i) : now_ns;
+        auto& prev = prev_[pid][dev];
+        if (prev.time_ns && cur.time_ns > prev.time_ns && cur.tx_bytes >= prev.tx_bytes) {
+          rates[pid][dev] = (cur.tx_bytes - prev.tx_bytes) * 1000000000 / (cur.time_ns - prev.time_ns);
+        }
+        prev = cur;
+      }
+    }
+  }
+
+  std::cout << std::endl << "=========================" << std::endl << std::flush;
+  print_real_time();
+  for (const auto& proc : rates) {
+    size_t total = 0;
+    for (const auto& dev : proc.second) total += dev.second;
+    size_t mean = total / proc.second.size();
+    std::cout << "[" << ranks[proc.first] << "][" << proc.first << "][tx_thruput_of_dev] ";
+    for (const auto& dev : proc.second) {
+      bool off = mean && (dev.second * 100 > mean * (100 + opts_.rail_tolerance) ||
+          dev.second * 100 < mean * std::max(100 - opts_.rail_tolerance, 0));
+      std::cout << "[" << dev.first << "]=" << human_string(dev.second) << "/s" << (off ? "(!) " : " ");
+    }
+    std::cout << "mean=" << human_string(mean) << "/s" << std::endl << std::flush;
+  }
+}
+
+void Monitor::lat_print_func() {
+  struct Row {
+    int rank, peer, dev, pid;
+    size_t count[2], p50[2], p99[2];
+  };
+  // Previous values of each stat, to show the latency of the last interval
+  static std::unordered_map<std::string, std::vector<size_t>> prev_;
+  static auto human_string = [](size_t ns)->std::string {
+    static std::string units[4] = {"ns", "us", "ms", "s"};
+    int index = 0;
+    while (ns >= 10000 && index < 3) {
+      ns /= 1000;
+      index++;
+    }
+    return std::to_string(ns) + units[index];
+  };
+
+  std::vector<Row> rows;
+  for (auto& stats : stats_records_) {
+    if (stats.first != "unet_lat_stats") {
+      continue;
+    }
+    for (auto& info : stats.second) {
+      info.refresh();
+      for (size_t i = 0; i < info.stat_num; i++) {
+        if (info.value(i, UNET_LAT_PID) == 0) continue;
+        auto& prev = prev_[info.shm + "." + std::to_string(i)];
+        prev.resize(info.counter_num, 0);
+        std::vector<size_t> cur(info.counter_num);
+        for (size_t j = 0; j < info.counter_num; j++) cur[j] = info.value(i, j);
+
+        Row row;
+        row.rank = cur[UNET_LAT_RANK];
+        row.peer = cur[UNET_LAT_PEER];
+        row.dev = cur[UNET_LAT_DEV];
+        row.pid = cur[UNET_LAT_PID];
+        size_t hists[2] = {UNET_LAT_SEND_NS, UNET_LAT_RECV_NS};
+        for (int h = 0; h < 2; h++) {
+          size_t buckets[Histogram::kBuckets];
+          for (size_t b = 0; b < Histogram::kBuckets; b++) {
+            buckets[b] = cur[hists[h] + 1 + b] - prev[hists[h] + 1 + b];
+          }
+          row.count[h] = cur[hists[h]] - prev[hists[h]];
+          row.p50[h] = Histogram::percentile(buckets, 0.5);
+          row.p99[h] = Histogram::percentile(buckets, 0.99);
+        }
+        prev.swap(cur);
+        if (row.count[0] || row.count[1]) rows.push_back(row);
+      }
+    }
+  }
+  std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) {
+    return std::make_tuple(a.rank, a.peer, a.dev) < std::make_tuple(b.rank, b.peer, b.dev);
+  });
+
+  std::cout << std::endl << "=========================" << std::endl << std::flush;
+  print_real_time();
+  std::cout << std::setw(8) << "rank" << std::setw(8) << "peer" << std::setw(8) << "dev"
+            << std::setw(12) << "send" << std::setw(12) << "p50" << std::setw(12) << "p99"
+            << std::setw(12) << "recv" << std::setw(12) << "p50" << std::setw(12) << "p99"
+            << std::setw(12) << "pid" << std::endl;
+  for (const auto& row : rows) {
+    std::cout << std::setw(8) << row.rank << std::setw(8) << row.peer << std::setw(8) << row.dev;
+    for (int h = 0; h < 2; h++) {
+      std::cout << std::setw(12) << row.count[h]
+                << std::setw(12) << human_string(row.p50[h]) << std::setw(12) << human_string(row.p99[h]);
+    }
+    std::cout << std::setw(12) << row.pid << std::endl;
+  }
+  std::cout << std::flush;
+}
+
+void Monitor::history_print_func() {
+  static auto human_string = [](size_t val)->std::string {
+    static std::string units[5] = {"", "K", "M", "G", "T"};
+    int index = 0;
+    while (val >= 10000 && index < 4) {
+      val /= 1000;
+      index++;
+    }
+    return std::to_string(val) + units[index];
+  };
+
+  std::cout << std::endl << "=========================" << std::endl << std::flush;
+  print_real_time();
+  bool has_ring = false;
+  for (auto& stats : stats_records_) {
+    for (auto& info : stats.second) {
+      if (!info.ring_data) continue;
+      has_ring = true;
+      std::vector<uint64_t> times;
+      std::vector<size_t> values;
+      info.read_ring(times, values);
+      if (times.size() < 2) continue;
+      size_t nc = info.ring_counters.size();
+      for (size_t i = 0; i < info.stat_num; i++) {
+        if (info.value(i, 0) == 0) continue;
+        std::cout << "[" << stats.first << "][" << info.value(i, 0) << "] "
+                  << times.size() << " samples over " << (times.back() - times.front()) / 1000000
+                  << "ms, every " << info.ring_interval_ms << "ms" << std::endl;
+        std::cout << std::setw(20) << "counter" << std::setw(12) << "mean/s" << std::setw(12) << "p50/s"
+                  << std::setw(12) << "p99/s" << std::setw(12) << "peak/s" << std::setw(12) << "peak_ago" << std::endl;
+        for (size_t k = 0; k < nc; k++) {
+          // Rates between consecutive samples
+          std::vector<std::pair<size_t, size_t>> rates; // rate, sample
+          for (size_t n = 1; n < times.size(); n++) {
+            size_t prev = values[((n - 1) * info.stat_num + i) * nc + k];
+            size_t cur = values[(n * info.stat_num + i) * nc + k];
+            if (cur < prev || times[n] <= times[n - 1]) continue;
+            rates.emplace_back((cur - prev) * 1000000000 / (times[n] - times[n - 1]), n);
+          }
+          size_t total = values[((times.size() - 1) * info.stat_num + i) * nc + k] - values[i * nc + k];
+          if (rates.empty() || total == 0) continue;
+          uint64_t span = times.back() - times.front();
+          size_t mean = span ? total * 1000000000 / span : 0;
+          auto peak = *std::max_element(rates.begin(), rates.end());
+          std::vector<size_t> sorted;
+          for (auto& r : rates) sorted.push_back(r.first);
+          std::sort(sorted.begin(), sorted.end());
+          std::cout << std::setw(20) << info.desc[info.ring_counters[k]]
+                    << std::setw(12) << human_string(mean)
+                    << std::setw(12) << human_string(sorted[sorted.size() / 2])
+                    << std::setw(12) << human_string(sorted[std::min(sorted.size() - 1, sorted.size() * 99 / 100)])
+                    << std::setw(12) << human_string(peak.first)
+                    << std::setw(10) << (times.back() - times[peak.second]) / 1000000 << "ms" << std::endl;
+        }
+      }
+    }
+  }
+  if (!has_ring) {
+    std::cout << "no history, the ring is off unless SICL_UCOMMD_STATS_RING_MS > 0" << std::endl;
+  }
+  std::cout << std::flush;
+}
+
 int Monitor::run() {
   struct itimerspec spec;
   memset(&spec, 0, sizeof(spec));
@@ -346,6 +704,7 @@ int Monitor::run() {
     return -1;
   }
 
+  int interval_ms = spec.it_interval.tv_sec * 1000 + spec.it_interval.tv_nsec / 1000000;
   size_t t = 0;
   long long check_pid_interval =
       (10LL * 1000000000LL) / (spec.it_interval.tv_sec * 1000000000LL + spec.it_interval.tv_nsec);
@@ -361,12 +720,28 @@ int Monitor::run() {
     }
 
     if (!(++t%check_pid_interval)) (void)check_ucommd_pids_stats();
+    mark_read(interval_ms);
 
     if (opts_.bw_print) {
       bw_print_func();
       continue;
     }
 
+    if (opts_.rail_print) {
+      rail_print_func();
+      continue;
+    }
+
+    if (opts_.lat_print) {
+      lat_print_func();
+      continue;
+    }
+
+    if (opts_.history_print) {
+      history_print_func();
+      continue;
+    }
+
     std::cout << std::endl << "=========================" << std::endl << std::flush;
     print_real_time();
 
@@ -376,7 +751,7 @@ int Monitor::run() {
       continue;
     }
 
-    for (const auto& stats : stats_records_) {
+    for (auto& stats : stats_records_) {
       const auto& stats_name = stats.first;
       if (stats_name.find("unet_bw_stats") != std::string::npos) {
         continue;
@@ -387,8 +762,14 @@ int Monitor::run() {
       std::cout << std::endl << stats_name << std::endl << std::flush;
 
       std::vector<size_t> width;
-      for (const auto& desc : stats.second.at(0).desc) {
-        if (desc.find("bytes") != std::string::npos) {
+      const auto& kind = stats.second.at(0).kind;
+      for (size_t i = 0; i < kind.size(); i++) {
+        const auto& desc = stats.second.at(0).desc[i];
+        if (kind[i] == kHistogramBucket) {
+          width.push_back(0);
+        } else if (kind[i] == kHistogram) {
+          width.push_back(24);
+        } else if (desc.find("bytes") != std::string::npos) {
           width.push_back(20);
         } else if (desc.length() <= 8) {
           width.push_back(8);
@@ -401,17 +782,22 @@ int Monitor::run() {
 
       const auto& desc = stats.second.at(0).desc;
       for (size_t i = 0; i < desc.size(); i++) {
-        std::cout << std::setw(width.at(i)) << desc[i] << "    ";
+        if (kind[i] == kHistogramBucket) continue;
+        std::cout << std::setw(width.at(i)) << (kind[i] == kHistogram ? desc[i] + "(p50/90/99)" : desc[i]) << "    ";
       }
       std::cout << std::endl << std::flush;
 
-      for (const auto& info : stats.second) {
+      for (auto& info : stats.second) {
+        info.refresh();
         for (size_t i = 0; i < info.stat_num; i++) {
-          auto base = info.data + i * info.counter_num;
-          if (*base == 0) continue;
+          if (info.value(i, 0) == 0) continue;
           for (size_t j = 0; j < info.counter_num; j++) {
-          //std::cout << std::setw(width.at(j)) << __atomic_load_n(base + j, __ATOMIC_SEQ_CST) << "    ";
-            std::cout << std::setw(width.at(j)) << *((volatile size_t*)(base + j)) << "    ";
+            if (info.kind[j] == kHistogramBucket) continue;
+            if (info.kind[j] == kHistogram) {
+              std::cout << std::setw(width.at(j)) << info.percentiles(i, j) << "    ";
+            } else {
+              std::cout << std::setw(width.at(j)) << info.value(i, j) << "    ";
+            }
           }
           std::cout << std::endl << std::flush;
         }
@@ -30,22 +30,69 @@ class Monitor {
     void* addr;
     size_t size;
     std::vector<std::string> desc;
+    std::vector<int> kind;
     volatile size_t* data;
     size_t counter_num;
     size_t stat_num;
+    size_t shard_num;
+    size_t shard_stride;
+    // Coherent copies of the stats, when the process publishes snapshots
+    const char* snap_data;
+    size_t snap_stride;
+    std::vector<size_t> snap;
+    std::vector<uint64_t> snap_time;
+    // Mapped writable, to tell the process we are watching
+    bool writable = false;
+    // History ring, when the process keeps one
+    const char* ring_data = nullptr;
+    size_t ring_stride = 0;
+    size_t ring_len = 0;
+    int ring_interval_ms = 0;
+    std::vector<int> ring_counters;
+    const volatile uint64_t* ring_head = nullptr;
     StatsShmInfo(const std::string& shm_name) :
         shm(shm_name), time(0),
         addr(nullptr), size(0),
-        data(nullptr), counter_num{0}, stat_num{0} {}
+        data(nullptr), counter_num{0}, stat_num{0},
+        shard_num{1}, shard_stride{0},
+        snap_data(nullptr), snap_stride{0} {}
+    // Take the snapshots of all stats, call before reading values
+    void refresh();
+    // Time of the snapshot values of stat i are from, 0 when reading live
+    uint64_t value_time(size_t i) const {
+      return snap_data ? snap_time[i] : 0;
+    }
+    // Counter j of stat i, summed over the shards
+    size_t value(size_t i, size_t j) const {
+      if (snap_data) return snap[i * counter_num + j];
+      size_t val = 0;
+      auto base = data + i * shard_num * shard_stride;
+      for (size_t s = 0; s < shard_num; s++) {
+        val += base[s * shard_stride + j];
+      }
+      return val;
+    }
+    // p50/p90/p99 of histogram j of stat i
+    std::string percentiles(size_t i, size_t j) const;
+    // Entries of the history ring, oldest first: their times and, for each,
+    // stat_num * ring_counters.size() values
+    void read_ring(std::vector<uint64_t>& times, std::vector<size_t>& values) const;
     ~StatsShmInfo() {
       shm.clear();
       time = 0;
       addr = nullptr;
       size = 0;
       desc.clear();
+      kind.clear();
       data = nullptr;
       counter_num = 0;
       stat_num = 0;
+      shard_num = 0;
+      shard_stride = 0;
+      snap_data = nullptr;
+      snap_stride = 0;
+      snap.clear();
+      snap_time.clear();
     }
   };
 
@@ -56,9 +103,13 @@ class Monitor {
   int scan_stats();
   int check_stats(StatsShmInfo& info);
   void clean_stats();
+  void mark_read(int interval_ms);
 
  private:
   void bw_print_func();
+  void rail_print_func();
+  void lat_print_func();
+  void history_print_func();
 
  private:
   static void print_real_time();
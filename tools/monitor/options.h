@@ -21,6 +21,10 @@ struct Options {
     { "pid",              required_argument,    0,    'p'     },
     { "show-bw",          no_argument,          0,    kOpt    },
     { "sample-interval",  required_argument,    0,    kOpt+1  },
+    { "show-rails",       no_argument,          0,    kOpt+2  },
+    { "rail-tolerance",   required_argument,    0,    kOpt+3  },
+    { "show-lat",         no_argument,          0,    kOpt+4  },
+    { "show-history",     no_argument,          0,    kOpt+5  },
     { "help",             no_argument,          0,    'h'     },
     { 0,                  0,                    0,     0      },
   };
@@ -30,6 +34,10 @@ struct Options {
   std::vector<int> pids;
   bool bw_print = false;
   long long interval_ns = -1;
+  bool rail_print = false;
+  int rail_tolerance = 20; // percent off the mean tx rate of the devices
+  bool lat_print = false;
+  bool history_print = false;
 
  public:
   int parseArgs(int argc, char* argv[]) {
@@ -50,6 +58,18 @@ struct Options {
       case kOpt+1:
         interval_ns = atoll(optarg);
         break;
+      case kOpt+2:
+        rail_print = true;
+        break;
+      case kOpt+3:
+        rail_tolerance = atoi(optarg);
+        break;
+      case kOpt+4:
+        lat_print = true;
+        break;
+      case kOpt+5:
+        history_print = true;
+        break;
       case 'h':
       case '?':
       default: